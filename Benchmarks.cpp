@@ -0,0 +1,435 @@
+#include "EGraph.h"
+#include "TestLanguage.h"
+#include "Serialization.h"
+#include "Runner.h"
+#include "Extraction.h"
+#include "Snapshot.h"
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+
+using namespace TestLanguage;
+
+//------------------------------------------------------------------------------
+// Workloads
+
+// A random polynomial over a few variables, where each node is a sum,
+// a difference or a product of two earlier nodes, mostly the recent ones,
+// so that it is deep and shared like the real expressions; it also has some
+// duplicate nodes, which are hits in the lookup when added to the graph
+e::TermDag makePolynomialDag(size_t nodesCount, const std::string &variablesSuffix = "")
+{
+    e::TermDag dag;
+
+    const e::Vector<e::Symbol> leaves{"x" + variablesSuffix, "y" + variablesSuffix,
+        "z" + variablesSuffix, "w" + variablesSuffix, "0", "1", "2", "3"};
+    const e::Vector<e::Symbol> operations{"+", "-", "*"};
+
+    std::mt19937 random(42);
+    std::geometric_distribution<uint32_t> distance(0.1);
+
+    for (uint32_t i = 0; i < std::min(nodesCount, leaves.size()); ++i)
+    {
+        dag.addNode(leaves[i], {});
+    }
+
+    while (dag.size() < nodesCount)
+    {
+        const auto size = uint32_t(dag.size());
+        const auto pick = [&]() { return size - 1 - std::min(distance(random), size - 1); };
+        const uint32_t children[2] = {pick(), pick()};
+        dag.addNode(operations[random() % operations.size()], {children, 2});
+    }
+
+    return dag;
+}
+
+// ((a0 + a1) + ...) + an, the classic explosive case for associativity and commutativity;
+// each operation is bracketed, since TestLanguage only parses the binary ones
+std::string makeSumChain(size_t length)
+{
+    std::string result = "a0";
+    for (size_t i = 1; i < length; ++i)
+    {
+        result = ((i > 1) ? "(" + result + ")" : result) + " + a" + std::to_string(i);
+    }
+
+    return result;
+}
+
+// The graph with the children stored inline, see FixedArityTermStore
+using BinaryGraph = e::BasicGraph<e::FixedArityGraphConfig<2>>;
+
+template <typename GraphType = e::Graph>
+GraphType makeGraph(const e::TermDag &dag)
+{
+    GraphType graph;
+    graph.addDag(dag);
+    return graph;
+}
+
+// Similar to egg's math suite, but only for the operations of the test language
+const e::Vector<e::RewriteRule> &getMathRules()
+{
+    static const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x + $y => $y + $x"),
+        makeRewriteRule("$x * $y => $y * $x"),
+        makeRewriteRule("$x + ($y + $z) => ($x + $y) + $z"),
+        makeRewriteRule("$x * ($y * $z) => ($x * $y) * $z"),
+        makeRewriteRule("$x - $y => $x + ((0 - 1) * $y)"),
+        makeRewriteRule("$x * ($y + $z) => ($x * $y) + ($x * $z)"),
+        makeRewriteRule("($x * $y) + ($x * $z) => $x * ($y + $z)"),
+        makeRewriteRule("$x + 0 => $x"),
+        makeRewriteRule("$x * 0 => 0"),
+        makeRewriteRule("$x * 1 => $x"),
+        makeRewriteRule("$x - $x => 0"),
+        makeRewriteRule("$x / $x => 1")};
+
+    return rules;
+}
+
+template <typename GraphType>
+void setCounters(benchmark::State &state, const GraphType &graph, size_t itemsCount)
+{
+    state.SetItemsProcessed(int64_t(state.iterations() * itemsCount));
+    state.counters["classes"] = double(graph.getClassesCount());
+    state.counters["terms"] = double(graph.getTermsCount());
+}
+
+//------------------------------------------------------------------------------
+// Adding terms
+
+void addTermsBenchmark(benchmark::State &state)
+{
+    const auto dag = makePolynomialDag(size_t(state.range(0)));
+
+    e::Graph graph;
+    e::Vector<e::ClassId> classIds(dag.size());
+    e::Vector<e::ClassId> childrenIds;
+
+    for (auto _ : state)
+    {
+        graph = {};
+        for (uint32_t i = 0; i < dag.size(); ++i)
+        {
+            childrenIds.clear();
+            for (const auto &childIndex : dag.getChildren(i))
+            {
+                childrenIds.push_back(classIds[childIndex]);
+            }
+
+            classIds[i] = graph.add(dag.getName(i), childrenIds);
+        }
+
+        benchmark::DoNotOptimize(classIds.data());
+    }
+
+    setCounters(state, graph, dag.size());
+}
+
+template <typename GraphType>
+void addDagBenchmark(benchmark::State &state)
+{
+    const auto dag = makePolynomialDag(size_t(state.range(0)));
+
+    GraphType graph;
+    for (auto _ : state)
+    {
+        graph = {};
+        benchmark::DoNotOptimize(graph.addDag(dag));
+    }
+
+    setCounters(state, graph, dag.size());
+}
+
+//------------------------------------------------------------------------------
+// Rewriting
+
+// The congruence closure of two copies of the same polynomial
+// over different variables, after uniting the variables,
+// so that every node of one copy gets merged into the other one
+template <typename GraphType>
+void restoreInvariantsBenchmark(benchmark::State &state)
+{
+    const auto dag1 = makePolynomialDag(size_t(state.range(0)) / 2);
+    const auto dag2 = makePolynomialDag(size_t(state.range(0)) / 2, "2");
+
+    GraphType graph;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        graph = makeGraph<GraphType>(dag1);
+        graph.addDag(dag2);
+        for (const auto &variable : {"x", "y", "z", "w"})
+        {
+            graph.unite(graph.addTerm(variable), graph.addTerm(std::string(variable) + "2"));
+        }
+        state.ResumeTiming();
+
+        graph.restoreInvariants();
+    }
+
+    setCounters(state, graph, size_t(state.range(0)));
+}
+
+// Finding the roots of many random ids at once, after many random unions,
+// like the rebuild does with its worklists, see UnionFind::canonicalize
+void canonicalizeBenchmark(benchmark::State &state)
+{
+    const auto setsCount = size_t(state.range(0));
+
+    std::mt19937 random(42);
+    e::UnionFind<e::ClassId> unionFind;
+    for (size_t i = 0; i < setsCount; ++i)
+    {
+        unionFind.addSet();
+    }
+
+    for (size_t i = 0; i < setsCount / 2; ++i)
+    {
+        unionFind.unite(unionFind.find(e::ClassId(random() % setsCount)),
+            unionFind.find(e::ClassId(random() % setsCount)));
+    }
+
+    e::Vector<e::ClassId> ids(setsCount);
+    for (auto &id : ids)
+    {
+        id = e::ClassId(random() % setsCount);
+    }
+
+    // canonicalize links the ids to their roots directly,
+    // so the trees are restored before each iteration
+    const auto parents = unionFind.parents;
+    e::Vector<e::ClassId> batch;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        unionFind.parents = parents;
+        batch = ids;
+        state.ResumeTiming();
+
+        unionFind.canonicalize(batch);
+        benchmark::DoNotOptimize(batch.data());
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations() * setsCount));
+}
+
+// One step of the whole rule set: search, apply and rebuild
+void rewriteBenchmark(benchmark::State &state)
+{
+    const auto dag = makePolynomialDag(size_t(state.range(0)));
+
+    e::Graph graph;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        graph = makeGraph(dag);
+        state.ResumeTiming();
+
+        graph.rewrite(getMathRules());
+    }
+
+    setCounters(state, graph, dag.size());
+}
+
+void searchBenchmark(benchmark::State &state)
+{
+    auto graph = makeGraph(makePolynomialDag(size_t(state.range(0))));
+
+    e::Vector<e::Matches> matches(getMathRules().size());
+    size_t matchesCount = 0;
+
+    for (auto _ : state)
+    {
+        matchesCount = 0;
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            graph.search(getMathRules()[i], matches[i]);
+            matchesCount += matches[i].size();
+        }
+    }
+
+    setCounters(state, graph, graph.getTermsCount());
+    state.counters["matches"] = double(matchesCount);
+}
+
+void saturationBenchmark(benchmark::State &state)
+{
+    const auto expression = makeSumChain(size_t(state.range(0)));
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x + $y => $y + $x"),
+        makeRewriteRule("$x + ($y + $z) => ($x + $y) + $z"),
+        makeRewriteRule("($x + $y) + $z => $x + ($y + $z)")};
+
+    e::Graph graph;
+    e::SaturationReport report;
+
+    for (auto _ : state)
+    {
+        graph = {};
+        makeExpression(expression, graph);
+
+        e::SaturationLimits limits;
+        limits.terms = limits.classes = 1000000;
+        limits.time = std::chrono::minutes(1);
+
+        e::Runner runner(graph, limits);
+        report = runner.run(rules);
+    }
+
+    setCounters(state, graph, graph.getTermsCount());
+    state.counters["iterations"] = double(report.iterations);
+}
+
+// Many short-lived graphs, one per request, which share the compiled rules;
+// with the pmr graph, each request allocates its classes and its operator index
+// from its own arena
+template <typename GraphType>
+void smallRequestBenchmark(benchmark::State &state)
+{
+    const auto expression = makeSumChain(size_t(state.range(0)));
+    const auto rules = makeRuleSet<GraphType>({
+        "$x + $y => $y + $x",
+        "$x + ($y + $z) => ($x + $y) + $z"});
+
+    size_t termsCount = 0;
+    e::SaturationReport report;
+
+    const auto serve = [&](GraphType &graph)
+    {
+        makeExpression(expression, graph);
+        report = e::Runner<GraphType>(graph).run(rules);
+        termsCount = graph.getTermsCount();
+    };
+
+    for (auto _ : state)
+    {
+        if constexpr (std::is_same_v<typename GraphType::Allocator, std::pmr::polymorphic_allocator<std::byte>>)
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            GraphType graph(&arena);
+            serve(graph);
+        }
+        else
+        {
+            GraphType graph;
+            serve(graph);
+        }
+    }
+
+    // e.g. an expression which the rules can't match saturates at once
+    if (report.iterations <= 1)
+    {
+        state.SkipWithError("The request has nothing to rewrite");
+    }
+
+    state.SetItemsProcessed(int64_t(state.iterations()));
+    state.counters["terms"] = double(termsCount);
+    state.counters["iterations"] = double(report.iterations);
+}
+
+//------------------------------------------------------------------------------
+// Extraction
+
+void extractionBenchmark(benchmark::State &state)
+{
+    e::Graph graph;
+    const auto root = graph.addDag(makePolynomialDag(size_t(state.range(0)))).back();
+    graph.rewrite(getMathRules());
+
+    size_t nodesCount = 0;
+    for (auto _ : state)
+    {
+        // the tree sizes of a deep DAG would overflow, so it's the depth
+        const e::Extractor<size_t> extractor(graph, e::astDepth);
+        nodesCount = extractor.extractDag(root)->size();
+    }
+
+    setCounters(state, graph, graph.getTermsCount());
+    state.counters["extracted"] = double(nodesCount);
+}
+
+//------------------------------------------------------------------------------
+// Serialization
+
+void serializeBenchmark(benchmark::State &state)
+{
+    const auto graph = makeGraph(makePolynomialDag(size_t(state.range(0))));
+
+    size_t bytesCount = 0;
+    for (auto _ : state)
+    {
+        const auto data = e::serialize(graph);
+        bytesCount = data.size();
+    }
+
+    setCounters(state, graph, graph.getTermsCount());
+    state.SetBytesProcessed(int64_t(state.iterations() * bytesCount));
+}
+
+void deserializeBenchmark(benchmark::State &state)
+{
+    const auto graph = makeGraph(makePolynomialDag(size_t(state.range(0))));
+    const auto data = e::serialize(graph);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(e::deserialize(data));
+    }
+
+    setCounters(state, graph, graph.getTermsCount());
+    state.SetBytesProcessed(int64_t(state.iterations() * data.size()));
+}
+
+void snapshotBenchmark(benchmark::State &state)
+{
+    const auto graph = makeGraph(makePolynomialDag(size_t(state.range(0))));
+
+    size_t wordsCount = 0;
+    for (auto _ : state)
+    {
+        const auto snapshot = e::makeSnapshot(graph);
+        wordsCount = snapshot.size();
+    }
+
+    setCounters(state, graph, graph.getTermsCount());
+    state.SetBytesProcessed(int64_t(state.iterations() * wordsCount * sizeof(uint32_t)));
+}
+
+void loadSnapshotBenchmark(benchmark::State &state)
+{
+    const auto graph = makeGraph(makePolynomialDag(size_t(state.range(0))));
+    const auto snapshot = e::makeSnapshot(graph);
+    const auto view = e::SnapshotView::open(snapshot.data(), snapshot.size() * sizeof(uint32_t));
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(view->load());
+    }
+
+    setCounters(state, graph, graph.getTermsCount());
+    state.SetBytesProcessed(int64_t(state.iterations() * snapshot.size() * sizeof(uint32_t)));
+}
+
+// From 10^3 to 10^7 nodes, the slower ones stop earlier
+BENCHMARK(addTermsBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(addDagBenchmark, e::Graph)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(addDagBenchmark, BinaryGraph)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(restoreInvariantsBenchmark, e::Graph)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(restoreInvariantsBenchmark, BinaryGraph)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK(canonicalizeBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK(searchBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 20)->Unit(benchmark::kMillisecond);
+BENCHMARK(rewriteBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 20)->Unit(benchmark::kMillisecond);
+BENCHMARK(saturationBenchmark)->DenseRange(4, 7)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(smallRequestBenchmark, e::Graph)->DenseRange(3, 6)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(smallRequestBenchmark, e::BasicGraph<e::PmrGraphConfig>)->DenseRange(3, 6)->Unit(benchmark::kMicrosecond);
+BENCHMARK(extractionBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK(serializeBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK(deserializeBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK(snapshotBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+BENCHMARK(loadSnapshotBenchmark)->RangeMultiplier(8)->Range(1 << 10, 1 << 23)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -10,13 +10,31 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <deque>
 #include <vector>
 #include <string>
 #include <optional>
 #include <variant>
 #include <unordered_map>
 #include <algorithm>
+#include <type_traits>
+#include <utility>
+
+// The vectorized union-find lookups, see UnionFind::canonicalize;
+// define EGRAPH_NO_SIMD to always use the scalar ones
+#if defined(__AVX2__) && !defined(EGRAPH_NO_SIMD)
+#include <immintrin.h>
+#define EGRAPH_HAS_AVX2 1
+#endif
 
 namespace e
 {
@@ -26,11 +44,6 @@ namespace e
 
 using ClassId = int32_t;
 
-// Symbols are used to name terms, and for now they are just strings,
-// but in future it could be refactored to use a symbol pool instead,
-// so that comparing them would be as fast as comparing pointers
-using Symbol = std::string;
-
 // In future this should probably be replaced by some more performant
 // or cache-friendly unordered_map-compatible hash map implementation
 template <typename K, typename V, typename H = std::hash<K>>
@@ -57,475 +70,3490 @@ using Variant = std::variant<T1, T2>;
 template <typename T>
 using Vector = std::vector<T>;
 
-template <typename T>
-inline void append(Vector<T> &v1, const Vector<T> &v2)
+template <typename T, typename A1, typename A2>
+inline void append(std::vector<T, A1> &v1, const std::vector<T, A2> &v2)
 {
     v1.insert(v1.end(), v2.begin(), v2.end());
 }
 
-//------------------------------------------------------------------------------
-// Disjoint-set forest a.k.a. union-find
-
-template <typename Id>
-struct UnionFind final
+// A non-owning view of a contiguous range of elements, like C++20 std::span
+template <typename T>
+struct Span final
 {
-    Id addSet()
+    Span() = default;
+
+    Span(T *data, size_t size) :
+        pointer(data), length(size) {}
+
+    // also takes the temporaries, e.g. a Span<T> to make a Span<const T>
+    template <typename Container>
+    Span(Container &&container) :
+        pointer(container.data()), length(container.size()) {}
+
+    T *data() const noexcept { return this->pointer; }
+    T *begin() const noexcept { return this->pointer; }
+    T *end() const noexcept { return this->pointer + this->length; }
+
+    size_t size() const noexcept { return this->length; }
+    bool empty() const noexcept { return this->length == 0; }
+
+    T &operator[](size_t index) const noexcept { return this->pointer[index]; }
+    T &front() const noexcept { return *this->pointer; }
+
+    Span subspan(size_t offset) const noexcept
     {
-        const auto id = this->parents.size();
-        this->parents.push_back(id);
-        return id;
+        assert(offset <= this->length);
+        return {this->pointer + offset, this->length - offset};
     }
 
-    Id find(Id id) const
+    Vector<std::remove_const_t<T>> toVector() const
     {
-        while (id != this->parents[id])
+        return {this->begin(), this->end()};
+    }
+
+private:
+
+    T *pointer = nullptr;
+    size_t length = 0;
+};
+
+template <typename T, typename A>
+inline void sortAndDeduplicate(std::vector<T, A> &v)
+{
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+inline void hashCombine(size_t &seed, size_t value) noexcept
+{
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+//------------------------------------------------------------------------------
+// A minimal thread pool for data-parallel loops: the range is split into
+// chunks, and all the threads, including the calling one, keep taking the next
+// chunk from a shared atomic counter until there are none left, so the threads
+// which are done with their chunks early just take over the remaining work
+
+struct ThreadPool final
+{
+    explicit ThreadPool(size_t threadsCount = std::thread::hardware_concurrency())
+    {
+        // the calling thread also does the work
+        for (size_t i = 1; i < std::max(threadsCount, size_t(1)); ++i)
         {
-            id = this->parents[id];
+            this->workers.emplace_back([this]() { this->workerLoop(); });
         }
-
-        return id;
     }
 
-    Id find(Id id)
+    ~ThreadPool()
     {
-        // The non-const find method also does path compression
-        while (id != this->parents[id])
         {
-            const auto grandparent = this->parents[this->parents[id]];
-            this->parents[id] = grandparent;
-            id = grandparent;
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
         }
 
-        return id;
+        this->jobStarted.notify_all();
+        for (auto &worker : this->workers)
+        {
+            worker.join();
+        }
     }
 
-    Id unite(Id root1, Id root2)
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t getThreadsCount() const noexcept
     {
-        this->parents[root2] = root1;
-        return root1;
+        return this->workers.size() + 1;
     }
 
-    Vector<Id> parents;
-};
+    // Calls function(chunkIndex, begin, end) for all chunks of [0, count)
+    // and returns when all of them are done
+    template <typename F>
+    void parallelFor(size_t count, size_t chunkSize, F &&function)
+    {
+        assert(chunkSize > 0);
+        const auto chunksCount = (count + chunkSize - 1) / chunkSize;
 
-//------------------------------------------------------------------------------
-// E-node, a term of some language
+        std::atomic<size_t> nextChunk{0};
+        const std::function<void()> job = [&]()
+        {
+            for (auto chunk = nextChunk.fetch_add(1); chunk < chunksCount; chunk = nextChunk.fetch_add(1))
+            {
+                const auto begin = chunk * chunkSize;
+                function(chunk, begin, std::min(count, begin + chunkSize));
+            }
+        };
 
-struct Term final
-{
-    explicit Term(const Symbol &name, const Vector<ClassId> &children = {}) :
-        name(name), childrenIds(children) {}
+        this->run(job);
+    }
 
-    using Ptr = SharedPointer<Term>;
+private:
 
-    struct Hash final
+    // Runs the job on all threads at once and waits for all of them
+    void run(const std::function<void()> &job)
     {
-        auto operator()(const Term::Ptr &x) const
         {
-            return std::hash<Symbol>()(x->name);
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->currentJob = &job;
+            this->pendingWorkers = this->workers.size();
+            this->generation++;
         }
-    };
 
-    friend bool operator==(const Term::Ptr &l, const Term::Ptr &r)
-    {
-        return l.get() == r.get() ||
-               (l->name == r->name && l->childrenIds == r->childrenIds);
-    }
+        this->jobStarted.notify_all();
 
-    friend bool operator<(const Term::Ptr &l, const Term::Ptr &r)
-    {
-        return l->name < r->name ||
-               (l->name == r->name && l->childrenIds < r->childrenIds);
+        job();
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->jobFinished.wait(lock, [this]() { return this->pendingWorkers == 0; });
+        this->currentJob = nullptr;
     }
 
-    template <typename UF>
-    void restoreInvariants(UF &unionFind)
+    void workerLoop()
     {
-        for (auto &id : this->childrenIds)
+        size_t lastGeneration = 0;
+        for (;;)
         {
-            id = unionFind.find(id);
+            const std::function<void()> *job = nullptr;
+
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->jobStarted.wait(lock, [&]()
+                    { return this->stopping || this->generation != lastGeneration; });
+
+                if (this->stopping)
+                {
+                    return;
+                }
+
+                lastGeneration = this->generation;
+                job = this->currentJob;
+            }
+
+            (*job)();
+
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->pendingWorkers--;
+            }
+
+            this->jobFinished.notify_one();
         }
     }
 
-    const Symbol name;
+    Vector<std::thread> workers;
 
-    // One of the key tricks here is that terms, a.k.a. e-nodes,
-    // are connected to equivalence classes, not other terms:
-    Vector<ClassId> childrenIds;
-};
+    std::mutex mutex;
+    std::condition_variable jobStarted;
+    std::condition_variable jobFinished;
 
-// The term id here is the leaf id, while the canonical class id is the root id:
-struct TermWithLeafId final
-{
-    Term::Ptr term;
-    ClassId termId;
+    const std::function<void()> *currentJob = nullptr;
+    size_t pendingWorkers = 0;
+    size_t generation = 0;
+    bool stopping = false;
 };
 
 //------------------------------------------------------------------------------
-// Equivalence class
+// Symbols are used to name terms; they are interned in a global symbol pool,
+// so that comparing and hashing them is as fast as comparing integers
 
-struct Class final
+struct SymbolPool final
 {
-    explicit Class(ClassId id) :
-        id(id) {}
-
-    Class(ClassId id, Term::Ptr term) :
-        id(id), terms({term}) {}
-
-    void addParent(Term::Ptr term, ClassId parentClassId)
+    static SymbolPool &getInstance()
     {
-        this->parents.push_back({term, parentClassId});
+        static SymbolPool pool;
+        return pool;
     }
 
-    void uniteWith(const Class *other)
+    uint32_t intern(const std::string &name)
     {
-        assert(other != this);
-        append(this->terms, other->terms);
-        append(this->parents, other->parents);
-    }
+        std::lock_guard<std::mutex> lock(this->mutex);
 
-    template <typename UF>
-    void restoreInvariants(UF &unionFind)
-    {
-        for (auto &term : this->terms)
+        const auto existing = this->ids.find(name);
+        if (existing != this->ids.end())
         {
-            term->restoreInvariants(unionFind);
+            return existing->second;
         }
 
-        // deduplicate
-        std::sort(this->terms.begin(), this->terms.end());
-        this->terms.erase(std::unique(this->terms.begin(), this->terms.end()), this->terms.end());
+        const auto id = static_cast<uint32_t>(this->names.size());
+        this->names.push_back(name);
+        this->ids.insert({name, id});
+        return id;
     }
 
-    const ClassId id;
-
-    Vector<Term::Ptr> terms;
+    const std::string &getName(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        assert(id < this->names.size());
+        return this->names[id];
+    }
 
-    Vector<TermWithLeafId> parents;
-};
+private:
 
-//------------------------------------------------------------------------------
-// E-matching and rewriting stuff
+    // the empty string always gets id 0, so that
+    // a default-constructed symbol is the empty name
+    SymbolPool() { this->intern({}); }
 
-struct PatternTerm;
-using PatternVariable = Symbol;
+    std::mutex mutex;
 
-// Match against pattern variables (or just symbols) for algebraic rewriting,
-// match against pattern terms for rewriting concrete named operations/terms,
-// e.g. the identity rule for a specific operation would look like:
-// <Symbol x> <PatternTerm op> <PatternTerm identity> -> <Symbol x>
-// and the zero rule would look like:
-// <Symbol x> <PatternTerm op> <PatternTerm zero> -> <PatternTerm zero>
-using Pattern = Variant<PatternVariable, PatternTerm>;
+    // deque never moves its elements, so the names can be safely referenced
+    std::deque<std::string> names;
 
-struct PatternTerm final
-{
-    Symbol name;
-    Vector<Pattern> arguments;
+    HashMap<std::string, uint32_t> ids;
 };
 
-struct SymbolBindings final
+struct Symbol final
 {
-    using Ptr = SharedPointer<SymbolBindings>;
-
-    SymbolBindings() = default;
-    explicit SymbolBindings(SymbolBindings::Ptr &other) :
-        bindings(other->bindings) {}
+    Symbol() = default;
 
-    Optional<ClassId> find(const Symbol &symbol)
-    {
-        const auto result = this->bindings.find(symbol);
-        if (result == this->bindings.end())
-        {
-            return {};
-        }
+    Symbol(const std::string &name) :
+        id(SymbolPool::getInstance().intern(name)) {}
 
-        return result->second;
-    }
+    Symbol(const char *name) :
+        Symbol(std::string(name)) {}
 
-    void add(const Symbol &symbol, ClassId classId)
+    const std::string &toString() const
     {
-        this->bindings[symbol] = classId;
+        return SymbolPool::getInstance().getName(this->id);
     }
 
-    HashMap<Symbol, ClassId> bindings;
-};
+    struct Hash final
+    {
+        auto operator()(const Symbol &x) const noexcept
+        {
+            return std::hash<uint32_t>()(x.id);
+        }
+    };
 
-struct RewriteRule final
-{
-    Pattern leftHand;
-    Pattern rightHand;
-};
+    // note that the ordering is the interning order, not the alphabetical one,
+    // which is fine for sorting and deduplication, but not for printing
+    friend bool operator==(const Symbol &l, const Symbol &r) noexcept { return l.id == r.id; }
+    friend bool operator!=(const Symbol &l, const Symbol &r) noexcept { return l.id != r.id; }
+    friend bool operator<(const Symbol &l, const Symbol &r) noexcept { return l.id < r.id; }
 
-struct Match final
-{
-    ClassId id1;
-    ClassId id2;
+    uint32_t id = 0;
 };
 
 //------------------------------------------------------------------------------
-// E-graph
+// Disjoint-set forest a.k.a. union-find
 
-struct Graph final
+template <typename Id>
+struct UnionFind final
 {
-    ClassId find(ClassId classId) const noexcept
-    {
-        return this->unionFind.find(classId);
-    }
+    // The single-threaded one, see ConcurrentUnionFind below
+    static constexpr bool isConcurrent = false;
 
-    ClassId addTerm(const Symbol &name)
+    Id addSet()
     {
-        return this->add(make<Term>(name));
+        const auto id = this->parents.size();
+        this->parents.push_back(id);
+        this->sizes.push_back(1);
+        return id;
     }
 
-    ClassId addOperation(const Symbol &name, const Vector<ClassId> &children)
+    Id find(Id id) const
     {
-        return this->add(make<Term>(name, children));
+        while (id != this->parents[id])
+        {
+            id = this->parents[id];
+        }
+
+        return id;
     }
 
-    bool unite(ClassId termId1, ClassId termId2)
+    Id find(Id id)
     {
-        const auto rootId1 = this->unionFind.find(termId1);
-        const auto rootId2 = this->unionFind.find(termId2);
-        if (rootId1 == rootId2)
+        // The non-const find method also does path compression
+        while (id != this->parents[id])
         {
-            return false;
+            const auto grandparent = this->parents[this->parents[id]];
+            this->parents[id] = grandparent;
+            id = grandparent;
         }
 
-        this->unionFind.unite(rootId1, rootId2);
-
-        auto *class1 = this->classes[rootId1].get();
-        auto *class2 = this->classes[rootId2].get();
+        return id;
+    }
 
-        class1->uniteWith(class2);
+    // Replaces all the ids with their roots, the same as calling find
+    // for each of them, which is what the rebuild does with the children
+    // of the terms and with its worklists; with AVX2, the parents of 8 ids
+    // are gathered at once, until all of them are roots, and then each id
+    // is linked to its root directly, instead of the path halving
+    void canonicalize(Span<Id> ids)
+    {
+        size_t i = 0;
 
-        this->classes.erase(rootId2);
+#if EGRAPH_HAS_AVX2
+        if constexpr (sizeof(Id) == sizeof(int32_t))
+        {
+            const auto *const parentsData = reinterpret_cast<const int *>(this->parents.data());
+            for (; i + 8 <= ids.size(); i += 8)
+            {
+                auto *const batch = reinterpret_cast<__m256i *>(ids.data() + i);
+                const auto initial = _mm256_loadu_si256(batch);
+
+                auto current = initial;
+                for (;;)
+                {
+                    const auto next = _mm256_i32gather_epi32(parentsData, current, sizeof(Id));
+                    const auto isRoot = _mm256_cmpeq_epi32(next, current);
+                    current = next;
+                    if (_mm256_movemask_epi8(isRoot) == -1)
+                    {
+                        break;
+                    }
+                }
+
+                _mm256_storeu_si256(batch, current);
+
+                alignas(32) Id initialIds[8];
+                _mm256_store_si256(reinterpret_cast<__m256i *>(initialIds), initial);
+                for (size_t j = 0; j < 8; ++j)
+                {
+                    this->parents[initialIds[j]] = ids[i + j];
+                }
+            }
+        }
+#endif
 
-        append(this->dirtyTerms, class1->parents);
-        return true;
+        for (; i < ids.size(); ++i)
+        {
+            ids[i] = this->find(ids[i]);
+        }
     }
 
-    void restoreInvariants()
+    // Union by size: the smaller tree is attached to the larger one,
+    // which keeps the trees logarithmically shallow; returns the new root
+    Id unite(Id root1, Id root2)
     {
-        // Rebuild unions
-
-        while (!this->dirtyTerms.empty())
+        assert(this->parents[root1] == root1 && this->parents[root2] == root2);
+        if (this->sizes[root1] < this->sizes[root2])
         {
-            const auto updated = this->dirtyTerms.back();
-            this->dirtyTerms.pop_back();
+            std::swap(root1, root2);
+        }
 
-            updated.term->restoreInvariants(this->unionFind);
+        this->parents[root2] = root1;
+        this->sizes[root1] += this->sizes[root2];
+        return root1;
+    }
 
-            const auto cachedTerm = this->termsLookup.find(updated.term);
-            assert(cachedTerm != this->termsLookup.end());
+    size_t size() const noexcept
+    {
+        return this->parents.size();
+    }
 
-            const auto cachedTermId = cachedTerm->second;
-            this->unite(cachedTermId, updated.termId);
-            this->termsLookup[updated.term] = updated.termId;
-        }
+    // In bytes, not counting the object itself
+    size_t getMemoryUsage() const noexcept
+    {
+        return this->parents.capacity() * sizeof(Id) + this->sizes.capacity() * sizeof(Id);
+    }
 
-        // Rebuild equivalence classes
+    void reserve(size_t setsCount)
+    {
+        this->parents.reserve(setsCount);
+        this->sizes.reserve(setsCount);
+    }
 
-        for (auto &[classId, classPtr] : this->classes)
-        {
-            classPtr->restoreInvariants(this->unionFind);
-        }
+    Vector<Id> getParents() const
+    {
+        return this->parents;
     }
 
-    void rewrite(const RewriteRule &rewriteRule)
+    void setParents(Vector<Id> newParents)
     {
-        Vector<ClassId> oldClassIds;
-        for (const auto &[classId, classPtr] : this->classes)
+        this->parents = std::move(newParents);
+        this->sizes.assign(this->parents.size(), 0);
+        for (size_t i = 0; i < this->parents.size(); ++i)
         {
-            oldClassIds.push_back(classId);
+            this->sizes[this->find(static_cast<Id>(i))]++;
         }
+    }
 
-        // Iterating only over the existing classes here,
-        // because this loop will instantiate more classes,
-        // and may get stuck, depending on rewrite rules
+    Vector<Id> parents;
 
-        Vector<Match> matches;
-        for (const auto &classId : oldClassIds)
-        {
-            SymbolBindings::Ptr emptyBindings = make<SymbolBindings>();
-            const auto matchResult = this->matchPattern(rewriteRule.leftHand, classId, emptyBindings);
-            for (const auto &bindings : matchResult)
-            {
-                matches.push_back({this->instantiatePattern(rewriteRule.leftHand, bindings),
-                    this->instantiatePattern(rewriteRule.rightHand, bindings)});
-            }
-        }
+    // only meaningful for the roots
+    Vector<Id> sizes;
+};
 
-        for (const auto &match : matches)
-        {
-            this->unite(match.id1, match.id2);
-        }
+// A lock-free union-find, which can be used from many threads at once:
+// the links are compare-and-swapped, and find does path halving, which is
+// fine to race with, since it only ever moves a node closer to its root;
+// the smaller id always becomes the root, instead of the union by size,
+// because the sizes can't be updated atomically along with the links,
+// and this also keeps the result the same no matter in which order
+// the threads unite the sets
+template <typename Id>
+struct ConcurrentUnionFind final
+{
+    static constexpr bool isConcurrent = true;
 
-        this->restoreInvariants();
+    ConcurrentUnionFind() = default;
+
+    ConcurrentUnionFind(const ConcurrentUnionFind &other)
+    {
+        this->setParents(other.getParents());
     }
 
-    Vector<SymbolBindings::Ptr> matchPattern(const Pattern &pattern,
-        ClassId classId, SymbolBindings::Ptr bindings)
+    ConcurrentUnionFind &operator=(const ConcurrentUnionFind &other)
     {
-        if (const auto *patternVariable = std::get_if<PatternVariable>(&pattern))
-        {
-            return this->matchVariable(*patternVariable, classId, bindings);
-        }
-        else if (const auto *patternTerm = std::get_if<PatternTerm>(&pattern))
+        this->setParents(other.getParents());
+        return *this;
+    }
+
+    ConcurrentUnionFind(ConcurrentUnionFind &&other) = default;
+    ConcurrentUnionFind &operator=(ConcurrentUnionFind &&other) = default;
+
+    // Adding the sets needs exclusive access: the deque doesn't move
+    // the existing atomics, but growing it can reallocate its map of blocks,
+    // which a concurrent find reads, so only the finds and the unions
+    // of the existing sets can run from many threads at once
+    Id addSet()
+    {
+        const auto id = static_cast<Id>(this->parents.size());
+        this->parents.emplace_back(id);
+        return id;
+    }
+
+    Id find(Id id) const noexcept
+    {
+        for (auto parent = this->parents[id].load(); parent != id; parent = this->parents[id].load())
         {
-            return this->matchTerm(*patternTerm, classId, bindings);
+            id = parent;
         }
 
-        assert(false);
-        return {};
+        return id;
     }
 
-    Vector<SymbolBindings::Ptr> matchVariable(const PatternVariable &variable,
-        ClassId classId, SymbolBindings::Ptr bindings)
+    Id find(Id id) noexcept
     {
-        Vector<SymbolBindings::Ptr> result;
-        const auto rootId = this->unionFind.find(classId);
-        if (const auto matchedClassId = bindings->find(variable))
+        for (;;)
         {
-            if (this->unionFind.find(matchedClassId.value()) == rootId)
+            auto parent = this->parents[id].load();
+            if (parent == id)
+            {
+                return id;
+            }
+
+            const auto grandparent = this->parents[parent].load();
+            if (parent != grandparent)
             {
-                result.push_back(bindings);
+                this->parents[id].compare_exchange_weak(parent, grandparent);
             }
+
+            id = grandparent;
         }
-        else
+    }
+
+    // The same as UnionFind::canonicalize, but the atomics are scattered
+    // over the deque's blocks, so there's nothing to gather here
+    void canonicalize(Span<Id> ids) noexcept
+    {
+        for (auto &id : ids)
         {
-            SymbolBindings::Ptr newBindings = make<SymbolBindings>(bindings);
-            newBindings->add(variable, rootId);
-            result.push_back(newBindings);
+            id = this->find(id);
         }
-
-        return result;
     }
 
-    Vector<SymbolBindings::Ptr> matchTerm(const PatternTerm &patternTerm,
-        ClassId classId, SymbolBindings::Ptr bindings)
+    // The arguments don't have to be roots here, since other threads
+    // may be uniting them at the same time; returns the new root
+    Id unite(Id id1, Id id2) noexcept
     {
-        const auto rootId = this->unionFind.find(classId);
-        assert(this->classes.find(rootId) != this->classes.end());
-
-        Vector<SymbolBindings::Ptr> result;
-        for (const auto &term : this->classes.at(rootId)->terms)
+        for (;;)
         {
-            if (term->name != patternTerm.name ||
-                term->childrenIds.size() != patternTerm.arguments.size())
+            auto root1 = this->find(id1);
+            auto root2 = this->find(id2);
+            if (root1 == root2)
             {
-                continue;
+                return root1;
+            }
+
+            if (root2 < root1)
+            {
+                std::swap(root1, root2);
             }
 
-            for (const auto &subBinding :
-                this->matchMany(patternTerm.arguments, term->childrenIds, bindings))
+            auto expected = root2;
+            if (this->parents[root2].compare_exchange_strong(expected, root1))
             {
-                result.push_back(subBinding);
+                return root1;
             }
         }
+    }
 
-        return result;
+    size_t size() const noexcept
+    {
+        return this->parents.size();
     }
 
-    Vector<SymbolBindings::Ptr> matchMany(const Vector<Pattern> &patterns,
-        const Vector<ClassId> &classIds, SymbolBindings::Ptr bindings)
+    // Roughly, since the deque allocates in blocks
+    size_t getMemoryUsage() const noexcept
     {
-        if (patterns.empty())
-        {
-            return {bindings};
-        }
+        return this->parents.size() * sizeof(std::atomic<Id>);
+    }
+
+    void reserve(size_t) {} // the deque grows in blocks anyway
 
-        Vector<SymbolBindings::Ptr> result;
-        for (const auto &subBinding1 : this->matchPattern(patterns.front(), classIds.front(), bindings))
+    Vector<Id> getParents() const
+    {
+        Vector<Id> result;
+        result.reserve(this->parents.size());
+        for (const auto &parent : this->parents)
         {
-            const Vector<Pattern> subPatterns(patterns.begin() + 1, patterns.end());
-            const Vector<ClassId> subClasses(classIds.begin() + 1, classIds.end());
-            for (const auto &subBinding2 : this->matchMany(subPatterns, subClasses, subBinding1))
-            {
-                result.push_back(subBinding2);
-            }
+            result.push_back(parent.load());
         }
 
         return result;
     }
 
-    ClassId instantiatePattern(const Pattern &pattern, SymbolBindings::Ptr bindings)
+    void setParents(const Vector<Id> &newParents)
     {
-        if (const auto *subVariable = std::get_if<PatternVariable>(&pattern))
+        this->parents.clear();
+        for (const auto &parent : newParents)
         {
-            return this->instantiateVariable(*subVariable, bindings);
+            this->parents.emplace_back(parent);
         }
-        else if (const auto *subTerm = std::get_if<PatternTerm>(&pattern))
-        {
-            return this->instantiateOperation(*subTerm, bindings);
+    }
+
+private:
+
+    std::deque<std::atomic<Id>> parents;
+};
+
+//------------------------------------------------------------------------------
+// E-node, a term of some language
+
+using TermId = int32_t;
+
+// Terms live in a flat arena and are addressed by their ids, see TermStore
+struct Term final
+{
+    Symbol name;
+
+    // One of the key tricks here is that terms, a.k.a. e-nodes,
+    // are connected to equivalence classes, not other terms;
+    // the children class ids are stored in TermStore's shared buffer:
+    uint32_t childrenOffset = 0;
+    uint32_t childrenCount = 0;
+
+    // The hash depends on the children ids, so a term must not be changed
+    // while it is stored in a hash map, see Graph::restoreInvariants
+    static size_t hash(const Symbol &name, Span<const ClassId> childrenIds) noexcept
+    {
+        auto result = Symbol::Hash()(name);
+        for (const auto &id : childrenIds)
+        {
+            hashCombine(result, std::hash<ClassId>()(id));
+        }
+
+        return result;
+    }
+};
+
+// Name and arity of a term, e.g. used to find all classes having some operation
+struct Operator final
+{
+    Symbol name;
+    uint32_t arity = 0;
+
+    struct Hash final
+    {
+        size_t operator()(const Operator &x) const noexcept
+        {
+            auto result = Symbol::Hash()(x.name);
+            hashCombine(result, std::hash<uint32_t>()(x.arity));
+            return result;
+        }
+    };
+
+    friend bool operator==(const Operator &l, const Operator &r) noexcept
+    {
+        return l.name == r.name && l.arity == r.arity;
+    }
+
+    friend bool operator<(const Operator &l, const Operator &r) noexcept
+    {
+        return l.name < r.name || (l.name == r.name && l.arity < r.arity);
+    }
+};
+
+// All terms of a graph are stored in one contiguous vector,
+// and all their children ids are stored in another one, CSR-style,
+// so that there's no per-term allocation or refcounting
+struct TermStore final
+{
+    TermId add(const Symbol &name, Span<const ClassId> childrenIds)
+    {
+        const auto id = static_cast<TermId>(this->terms.size());
+        const auto offset = static_cast<uint32_t>(this->childrenIds.size());
+        const auto count = static_cast<uint32_t>(childrenIds.size());
+        this->terms.push_back({name, offset, count});
+        this->childrenIds.insert(this->childrenIds.end(), childrenIds.begin(), childrenIds.end());
+        return id;
+    }
+
+    const Symbol &getName(TermId id) const noexcept
+    {
+        return this->terms[id].name;
+    }
+
+    Operator getOperator(TermId id) const noexcept
+    {
+        return {this->terms[id].name, this->terms[id].childrenCount};
+    }
+
+    Span<const ClassId> getChildren(TermId id) const noexcept
+    {
+        const auto &term = this->terms[id];
+        return {this->childrenIds.data() + term.childrenOffset, term.childrenCount};
+    }
+
+    Span<ClassId> getChildren(TermId id) noexcept
+    {
+        const auto &term = this->terms[id];
+        return {this->childrenIds.data() + term.childrenOffset, term.childrenCount};
+    }
+
+    size_t hash(TermId id) const noexcept
+    {
+        return Term::hash(this->getName(id), this->getChildren(id));
+    }
+
+    bool equals(TermId id, const Symbol &name, Span<const ClassId> childrenIds) const noexcept
+    {
+        const auto children = this->getChildren(id);
+        return this->getName(id) == name &&
+               std::equal(children.begin(), children.end(), childrenIds.begin(), childrenIds.end());
+    }
+
+    bool equals(TermId l, TermId r) const noexcept
+    {
+        return l == r || this->equals(l, this->getName(r), this->getChildren(r));
+    }
+
+    bool less(TermId l, TermId r) const noexcept
+    {
+        const auto &lName = this->getName(l);
+        const auto &rName = this->getName(r);
+        if (lName != rName)
+        {
+            return lName < rName;
+        }
+
+        const auto lChildren = this->getChildren(l);
+        const auto rChildren = this->getChildren(r);
+        return std::lexicographical_compare(lChildren.begin(), lChildren.end(),
+            rChildren.begin(), rChildren.end());
+    }
+
+    template <typename UF>
+    void restoreInvariants(TermId id, UF &unionFind)
+    {
+        unionFind.canonicalize(this->getChildren(id));
+    }
+
+    size_t size() const noexcept
+    {
+        return this->terms.size();
+    }
+
+    // Makes sure that this many more terms with this many children in total fit
+    void reserve(size_t newTermsCount, size_t newChildrenCount)
+    {
+        this->terms.reserve(this->terms.size() + newTermsCount);
+        this->childrenIds.reserve(this->childrenIds.size() + newChildrenCount);
+    }
+
+    size_t getMemoryUsage() const noexcept
+    {
+        return this->terms.capacity() * sizeof(Term) + this->childrenIds.capacity() * sizeof(ClassId);
+    }
+
+    Vector<Term> terms;
+
+    Vector<ClassId> childrenIds;
+};
+
+// A term with its children stored inline, see FixedArityTermStore;
+// the unused children slots are always zero
+template <uint32_t MaxArity>
+struct FixedArityTerm final
+{
+    Symbol name;
+    uint32_t childrenCount = 0;
+    ClassId childrenIds[MaxArity] = {};
+};
+
+// The same interface as TermStore's, but for the languages where no term
+// has more than MaxArity children, e.g. the binary arithmetic expressions:
+// each term is then one fixed-size record, so reading it touches one place
+// instead of two, and the stored terms are compared as a whole, without
+// branching on their arities; see FixedArityGraphConfig
+template <uint32_t MaxArity>
+struct FixedArityTermStore final
+{
+    static_assert(MaxArity > 0, "Use TermStore for the languages without operations");
+
+    using Term = FixedArityTerm<MaxArity>;
+
+    TermId add(const Symbol &name, Span<const ClassId> childrenIds)
+    {
+        assert(childrenIds.size() <= MaxArity);
+        const auto id = static_cast<TermId>(this->terms.size());
+        auto &term = this->terms.emplace_back();
+        term.name = name;
+        term.childrenCount = static_cast<uint32_t>(childrenIds.size());
+        std::copy(childrenIds.begin(), childrenIds.end(), term.childrenIds);
+        return id;
+    }
+
+    const Symbol &getName(TermId id) const noexcept
+    {
+        return this->terms[id].name;
+    }
+
+    Operator getOperator(TermId id) const noexcept
+    {
+        return {this->terms[id].name, this->terms[id].childrenCount};
+    }
+
+    Span<const ClassId> getChildren(TermId id) const noexcept
+    {
+        const auto &term = this->terms[id];
+        return {term.childrenIds, term.childrenCount};
+    }
+
+    Span<ClassId> getChildren(TermId id) noexcept
+    {
+        auto &term = this->terms[id];
+        return {term.childrenIds, term.childrenCount};
+    }
+
+    // Has to be the same as for the unstored terms, see TermsLookup::findEntry
+    size_t hash(TermId id) const noexcept
+    {
+        return e::Term::hash(this->getName(id), this->getChildren(id));
+    }
+
+    bool equals(TermId id, const Symbol &name, Span<const ClassId> childrenIds) const noexcept
+    {
+        const auto children = this->getChildren(id);
+        return this->getName(id) == name &&
+               std::equal(children.begin(), children.end(), childrenIds.begin(), childrenIds.end());
+    }
+
+    // The unused slots are zeros in both, and the records have no padding,
+    // so they are compared as a whole, which the compiler does with
+    // a few vector compares, e.g. one for the 16-byte binary terms
+    bool equals(TermId l, TermId r) const noexcept
+    {
+        static_assert(sizeof(Term) == sizeof(uint32_t) * (MaxArity + 2), "The terms have no padding");
+        return std::memcmp(&this->terms[l], &this->terms[r], sizeof(Term)) == 0;
+    }
+
+    bool less(TermId l, TermId r) const noexcept
+    {
+        const auto &lTerm = this->terms[l];
+        const auto &rTerm = this->terms[r];
+        if (lTerm.name != rTerm.name)
+        {
+            return lTerm.name < rTerm.name;
+        }
+
+        return std::lexicographical_compare(lTerm.childrenIds, lTerm.childrenIds + lTerm.childrenCount,
+            rTerm.childrenIds, rTerm.childrenIds + rTerm.childrenCount);
+    }
+
+    template <typename UF>
+    void restoreInvariants(TermId id, UF &unionFind)
+    {
+        unionFind.canonicalize(this->getChildren(id));
+    }
+
+    size_t size() const noexcept
+    {
+        return this->terms.size();
+    }
+
+    void reserve(size_t newTermsCount, size_t)
+    {
+        this->terms.reserve(this->terms.size() + newTermsCount);
+    }
+
+    size_t getMemoryUsage() const noexcept
+    {
+        return this->terms.capacity() * sizeof(Term);
+    }
+
+    Vector<Term> terms;
+};
+
+// The hashcons, an open-addressing hash map from terms to class ids;
+// it only stores term ids and compares the terms via the term store,
+// so looking up a term doesn't require adding it to the store first
+struct TermsLookup final
+{
+    struct Entry final
+    {
+        TermId termId;
+        ClassId classId;
+    };
+
+    // Returns the stored term equal to the given one and its class id
+    template <typename Store>
+    Optional<Entry> findEntry(const Store &store,
+        const Symbol &name, Span<const ClassId> childrenIds) const noexcept
+    {
+        if (this->slots.empty())
+        {
+            return {};
+        }
+
+        const auto mask = this->slots.size() - 1;
+        const auto hash = Term::hash(name, childrenIds);
+        for (auto i = hash & mask;; i = (i + 1) & mask)
+        {
+            const auto &slot = this->slots[i];
+            if (slot.termId == Slot::empty)
+            {
+                return {};
+            }
+
+            if (slot.hash == hash && store.equals(slot.termId, name, childrenIds))
+            {
+                return Entry{slot.termId, slot.classId};
+            }
+        }
+    }
+
+    template <typename Store>
+    Optional<Entry> findEntry(const Store &store, TermId termId) const noexcept
+    {
+        return this->findEntry(store, store.getName(termId), store.getChildren(termId));
+    }
+
+    template <typename Store>
+    Optional<ClassId> find(const Store &store,
+        const Symbol &name, Span<const ClassId> childrenIds) const noexcept
+    {
+        if (const auto entry = this->findEntry(store, name, childrenIds))
+        {
+            return entry->classId;
+        }
+
+        return {};
+    }
+
+    // Assumes that there's no equal term in the lookup yet
+    template <typename Store>
+    void insert(const Store &store, TermId termId, ClassId classId)
+    {
+        if ((this->count + 1) * 4 > this->slots.size() * 3)
+        {
+            this->grow();
+        }
+
+        this->insertSlot({store.hash(termId), termId, classId});
+        this->count++;
+    }
+
+    // Makes sure that this many entries fit without growing
+    void reserve(size_t entriesCount)
+    {
+        auto slotsCount = std::max(size_t(16), this->slots.size());
+        while (entriesCount * 4 > slotsCount * 3)
+        {
+            slotsCount *= 2;
+        }
+
+        if (slotsCount != this->slots.size())
+        {
+            this->rehash(slotsCount);
+        }
+    }
+
+    // Removes the entry of exactly this term id, if any, not just of an equal term
+    template <typename Store>
+    bool erase(const Store &store, TermId termId)
+    {
+        if (this->slots.empty())
+        {
+            return false;
+        }
+
+        const auto mask = this->slots.size() - 1;
+        auto i = store.hash(termId) & mask;
+        for (; this->slots[i].termId != termId; i = (i + 1) & mask)
+        {
+            if (this->slots[i].termId == Slot::empty)
+            {
+                return false;
+            }
+        }
+
+        // backward shift deletion, so that the probe sequences stay intact
+        for (auto j = (i + 1) & mask; this->slots[j].termId != Slot::empty; j = (j + 1) & mask)
+        {
+            const auto ideal = this->slots[j].hash & mask;
+            const auto stays = (i <= j) ? (i < ideal && ideal <= j) : (i < ideal || ideal <= j);
+            if (!stays)
+            {
+                this->slots[i] = this->slots[j];
+                i = j;
+            }
+        }
+
+        this->slots[i] = {};
+        this->count--;
+        return true;
+    }
+
+    template <typename F>
+    void forEach(F &&function) const
+    {
+        for (const auto &slot : this->slots)
+        {
+            if (slot.termId != Slot::empty)
+            {
+                function(slot.termId, slot.classId);
+            }
+        }
+    }
+
+    size_t size() const noexcept
+    {
+        return this->count;
+    }
+
+    size_t getMemoryUsage() const noexcept
+    {
+        return this->slots.capacity() * sizeof(Slot);
+    }
+
+private:
+
+    struct Slot final
+    {
+        static constexpr TermId empty = -1;
+
+        size_t hash = 0;
+        TermId termId = empty;
+        ClassId classId = -1;
+    };
+
+    void insertSlot(const Slot &newSlot)
+    {
+        const auto mask = this->slots.size() - 1;
+        auto i = newSlot.hash & mask;
+        while (this->slots[i].termId != Slot::empty)
+        {
+            i = (i + 1) & mask;
+        }
+
+        this->slots[i] = newSlot;
+    }
+
+    void grow()
+    {
+        this->rehash(std::max(size_t(16), this->slots.size() * 2));
+    }
+
+    void rehash(size_t slotsCount)
+    {
+        Vector<Slot> oldSlots(slotsCount);
+        std::swap(oldSlots, this->slots);
+        for (const auto &slot : oldSlots)
+        {
+            if (slot.termId != Slot::empty)
+            {
+                this->insertSlot(slot);
+            }
+        }
+    }
+
+    // the size is always a power of two
+    Vector<Slot> slots;
+
+    size_t count = 0;
+};
+
+// A term used in some class, along with the class id this term was added as;
+// the latter is the leaf id, while the canonical class id is the root id:
+struct TermWithLeafId final
+{
+    TermId termId;
+    ClassId leafId;
+};
+
+//------------------------------------------------------------------------------
+// Equivalence class
+
+// The terms and parents lists of all classes are most of the graph's
+// small allocations, so they take the allocator from the graph's config,
+// e.g. see PmrGraphConfig; the allocator-taking constructors are the ones
+// the containers with the scoped allocators like std::pmr use
+template <typename Allocator = std::allocator<std::byte>>
+struct BasicClass final
+{
+    using allocator_type = Allocator;
+
+    template <typename T>
+    using List = std::vector<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+    explicit BasicClass(ClassId id, const Allocator &allocator = {}) :
+        id(id), terms(allocator), parents(allocator) {}
+
+    BasicClass(ClassId id, TermId term, const Allocator &allocator = {}) :
+        id(id), terms({term}, allocator), parents(allocator) {}
+
+    BasicClass(const BasicClass &other) = default;
+    BasicClass(BasicClass &&other) = default;
+
+    BasicClass(const BasicClass &other, const Allocator &allocator) :
+        id(other.id), terms(other.terms, allocator),
+        parents(other.parents, allocator), alive(other.alive) {}
+
+    BasicClass(BasicClass &&other, const Allocator &allocator) :
+        id(other.id), terms(std::move(other.terms), allocator),
+        parents(std::move(other.parents), allocator), alive(other.alive) {}
+
+    void addParent(TermId term, ClassId parentClassId)
+    {
+        this->parents.push_back({term, parentClassId});
+    }
+
+    void uniteWith(BasicClass &other)
+    {
+        assert(&other != this);
+        assert(this->alive && other.alive);
+
+        // always copy the smaller vectors into the larger ones,
+        // so that each item is only copied O(log n) times in total
+        if (this->terms.size() < other.terms.size())
+        {
+            std::swap(this->terms, other.terms);
+        }
+
+        if (this->parents.size() < other.parents.size())
+        {
+            std::swap(this->parents, other.parents);
+        }
+
+        append(this->terms, other.terms);
+        append(this->parents, other.parents);
+        other.makeTombstone();
+    }
+
+    // Classes are stored densely by id, so the merged-away ones
+    // are not erased, but kept as empty slots marked as dead
+    void makeTombstone()
+    {
+        this->alive = false;
+        List<TermId>(this->terms.get_allocator()).swap(this->terms);
+        List<TermWithLeafId>(this->parents.get_allocator()).swap(this->parents);
+    }
+
+    bool isAlive() const noexcept
+    {
+        return this->alive;
+    }
+
+    // Including the object itself, since the classes are stored by value
+    size_t getMemoryUsage() const noexcept
+    {
+        return sizeof(BasicClass) + this->terms.capacity() * sizeof(TermId) +
+            this->parents.capacity() * sizeof(TermWithLeafId);
+    }
+
+    template <typename UF, typename Store>
+    void restoreInvariants(UF &unionFind, Store &store)
+    {
+        for (const auto &term : this->terms)
+        {
+            store.restoreInvariants(term, unionFind);
+        }
+
+        // deduplicate
+        std::sort(this->terms.begin(), this->terms.end(),
+            [&store](TermId l, TermId r) { return store.less(l, r); });
+        this->terms.erase(std::unique(this->terms.begin(), this->terms.end(),
+                              [&store](TermId l, TermId r) { return store.equals(l, r); }),
+            this->terms.end());
+    }
+
+    const ClassId id;
+
+    List<TermId> terms;
+
+    List<TermWithLeafId> parents;
+
+private:
+
+    bool alive = true;
+};
+
+using Class = BasicClass<>;
+
+//------------------------------------------------------------------------------
+// E-matching and rewriting stuff
+
+struct PatternTerm;
+using PatternVariable = Symbol;
+
+// Match against pattern variables (or just symbols) for algebraic rewriting,
+// match against pattern terms for rewriting concrete named operations/terms,
+// e.g. the identity rule for a specific operation would look like:
+// <Symbol x> <PatternTerm op> <PatternTerm identity> -> <Symbol x>
+// and the zero rule would look like:
+// <Symbol x> <PatternTerm op> <PatternTerm zero> -> <PatternTerm zero>
+using Pattern = Variant<PatternVariable, PatternTerm>;
+
+struct PatternTerm final
+{
+    Symbol name;
+    Vector<Pattern> arguments;
+};
+
+// Patterns are compiled into programs for a simple e-matching virtual machine,
+// as described in "Efficient E-matching for SMT Solvers" by de Moura and
+// Bjørner, and as used in egg: the machine has registers holding class ids,
+// where the register 0 is the class being matched, and the Bind instruction
+// iterates all fitting terms of a class, backtracking to the next term
+// once the rest of the program has been executed for the current one
+struct MatchingProgram final
+{
+    struct Instruction final
+    {
+        enum class Type : uint8_t
+        {
+            // For each term in the input register's class, which has the given
+            // name and arity, put its children into the output registers
+            Bind,
+            // Check that the input and the output registers hold the same class
+            Compare
+        };
+
+        Type type;
+        uint32_t input;
+        uint32_t output;
+        Symbol name;
+        uint32_t arity;
+    };
+
+    static MatchingProgram compile(const Pattern &pattern)
+    {
+        MatchingProgram program;
+        program.compilePattern(pattern, 0);
+        return program;
+    }
+
+    // Only the classes having a term with this operator can match, if the
+    // pattern is a term, but a pattern which is a variable matches any class
+    Optional<Operator> getRootOperator() const noexcept
+    {
+        if (this->instructions.empty())
+        {
+            return {};
+        }
+
+        const auto &first = this->instructions.front();
+        assert(first.type == Instruction::Type::Bind && first.input == 0);
+        return Operator{first.name, first.arity};
+    }
+
+    Vector<Instruction> instructions;
+
+    // Once the whole program has run, variables[i] is bound to the class
+    // in the register variableRegisters[i]
+    Vector<PatternVariable> variables;
+    Vector<uint32_t> variableRegisters;
+
+    uint32_t registersCount = 1;
+
+private:
+
+    void compilePattern(const Pattern &pattern, uint32_t input)
+    {
+        if (const auto *patternVariable = std::get_if<PatternVariable>(&pattern))
+        {
+            this->compileVariable(*patternVariable, input);
+        }
+        else if (const auto *patternTerm = std::get_if<PatternTerm>(&pattern))
+        {
+            const auto output = this->registersCount;
+            const auto arity = static_cast<uint32_t>(patternTerm->arguments.size());
+            this->instructions.push_back({Instruction::Type::Bind, input, output, patternTerm->name, arity});
+            this->registersCount += arity;
+
+            // Variables go first, so that the repeated ones are compared as soon
+            // as possible, before going deeper and iterating more terms
+
+            for (uint32_t i = 0; i < arity; ++i)
+            {
+                if (const auto *argument = std::get_if<PatternVariable>(&patternTerm->arguments[i]))
+                {
+                    this->compileVariable(*argument, output + i);
+                }
+            }
+
+            for (uint32_t i = 0; i < arity; ++i)
+            {
+                if (std::holds_alternative<PatternTerm>(patternTerm->arguments[i]))
+                {
+                    this->compilePattern(patternTerm->arguments[i], output + i);
+                }
+            }
+        }
+        else
+        {
+            assert(false);
+        }
+    }
+
+    void compileVariable(const PatternVariable &variable, uint32_t input)
+    {
+        const auto existing = std::find(this->variables.begin(), this->variables.end(), variable);
+        if (existing == this->variables.end())
+        {
+            this->variables.push_back(variable);
+            this->variableRegisters.push_back(input);
+        }
+        else
+        {
+            const auto boundRegister = this->variableRegisters[existing - this->variables.begin()];
+            this->instructions.push_back({Instruction::Type::Compare, boundRegister, input, {}, 0});
+        }
+    }
+};
+
+// A read-only view of one match: the class ids bound to pattern variables
+struct SymbolBindings final
+{
+    Optional<ClassId> find(const Symbol &symbol) const
+    {
+        for (size_t i = 0; i < this->variables.size(); ++i)
+        {
+            if (this->variables[i] == symbol && this->classIds[i] >= 0)
+            {
+                return this->classIds[i];
+            }
+        }
+
+        return {};
+    }
+
+    Span<const PatternVariable> variables;
+    Span<const ClassId> classIds;
+
+    // The class matched by the whole pattern
+    ClassId root = -1;
+};
+
+// All matches of a pattern, stored flat, one substitution after another,
+// so that this buffer can be reused without allocating for each match
+struct Matches final
+{
+    size_t size() const noexcept
+    {
+        return this->roots.size();
+    }
+
+    bool empty() const noexcept
+    {
+        return this->size() == 0;
+    }
+
+    SymbolBindings operator[](size_t index) const noexcept
+    {
+        const auto stride = this->variables.size();
+        return {this->variables, {this->substitutions.data() + index * stride, stride}, this->roots[index]};
+    }
+
+    void add(const Vector<ClassId> &registers,
+        const Vector<uint32_t> &variableRegisters, uint32_t rootRegister)
+    {
+        for (const auto &variableRegister : variableRegisters)
+        {
+            this->substitutions.push_back(registers[variableRegister]);
+        }
+
+        this->roots.push_back(registers[rootRegister]);
+    }
+
+    void append(const Matches &other)
+    {
+        e::append(this->substitutions, other.substitutions);
+        e::append(this->roots, other.roots);
+    }
+
+    // keeps the capacity
+    void clear() noexcept
+    {
+        this->variables.clear();
+        this->substitutions.clear();
+        this->roots.clear();
+    }
+
+    Vector<PatternVariable> variables;
+
+    Vector<ClassId> substitutions;
+
+    // The class matched by the whole pattern, one per match,
+    // so that the left hand side doesn't have to be instantiated to find it
+    Vector<ClassId> roots;
+};
+
+// An alternative way of matching, as described in "Relational E-matching"
+// by Zhang et al.: each pattern term is an atom of a conjunctive query, where
+// the atom's relation is all terms with the atom's operator, i.e. the tuples
+// of (class id, children ids...), and the query is evaluated with generic join,
+// binding one query variable at a time to the intersection of the candidates
+// from all atoms having it, so that non-linear patterns like $x - $x are
+// filtered as early as possible instead of at the end of a tree walk
+struct MatchingQuery final
+{
+    struct Atom final
+    {
+        Operator op;
+
+        // The query variables for the term's class and then its children
+        Vector<uint32_t> variables;
+    };
+
+    static MatchingQuery compile(const Pattern &pattern)
+    {
+        MatchingQuery query;
+        query.rootVariable = query.compilePattern(pattern);
+        query.computeOrder();
+        return query;
+    }
+
+    Vector<Atom> atoms;
+
+    // The pattern variables are query variables too,
+    // along with the ones for the classes of the pattern terms
+    Vector<PatternVariable> variables;
+    Vector<uint32_t> variableIds;
+
+    uint32_t variablesCount = 0;
+
+    // The order in which the query variables are bound
+    Vector<uint32_t> order;
+
+    // The variable for the class of the whole pattern
+    uint32_t rootVariable = 0;
+
+private:
+
+    uint32_t compilePattern(const Pattern &pattern)
+    {
+        if (const auto *patternVariable = std::get_if<PatternVariable>(&pattern))
+        {
+            const auto existing = std::find(this->variables.begin(), this->variables.end(), *patternVariable);
+            if (existing != this->variables.end())
+            {
+                return this->variableIds[existing - this->variables.begin()];
+            }
+
+            this->variables.push_back(*patternVariable);
+            this->variableIds.push_back(this->variablesCount);
+            return this->variablesCount++;
+        }
+
+        const auto &patternTerm = std::get<PatternTerm>(pattern);
+        const auto termVariable = this->variablesCount++;
+
+        Atom atom;
+        atom.op = {patternTerm.name, static_cast<uint32_t>(patternTerm.arguments.size())};
+        atom.variables.push_back(termVariable);
+        for (const auto &argument : patternTerm.arguments)
+        {
+            atom.variables.push_back(this->compilePattern(argument));
+        }
+
+        this->atoms.push_back(std::move(atom));
+        return termVariable;
+    }
+
+    // A simple heuristic: the variables shared by more atoms go first,
+    // since they constrain the search the most, and the ties are broken
+    // by the variable id, i.e. preferring the ones closer to the root
+    void computeOrder()
+    {
+        Vector<uint32_t> occurrences(this->variablesCount, 0);
+        for (const auto &atom : this->atoms)
+        {
+            auto atomVariables = atom.variables;
+            sortAndDeduplicate(atomVariables);
+            for (const auto &variable : atomVariables)
+            {
+                occurrences[variable]++;
+            }
+        }
+
+        this->order.resize(this->variablesCount);
+        for (uint32_t i = 0; i < this->variablesCount; ++i)
+        {
+            this->order[i] = i;
+        }
+
+        std::stable_sort(this->order.begin(), this->order.end(),
+            [&occurrences](uint32_t l, uint32_t r) { return occurrences[l] > occurrences[r]; });
+    }
+};
+
+enum class MatchingEngine : uint8_t
+{
+    Default, // whatever the graph uses by default
+    Machine, // the backtracking virtual machine, see MatchingProgram
+    Relational // the generic join, see MatchingQuery
+};
+
+template <typename Config>
+struct BasicGraph;
+
+// The rules are bound to the graph type, since their callbacks get the graph
+template <typename GraphType>
+struct BasicRewriteRule final
+{
+    // Returns false to skip the match, e.g. for $x / $x => 1 if $x is 0;
+    // it is called before instantiating anything, but the graph
+    // might not be rebuilt yet after applying the previous rules
+    using Guard = std::function<bool(const SymbolBindings &bindings, const GraphType &graph)>;
+
+    // Makes the right hand side instead of the pattern, e.g. a computed literal,
+    // and returns its class to unite with the match, or nothing to skip it
+    using Applier = std::function<Optional<ClassId>(const SymbolBindings &bindings, GraphType &graph)>;
+
+    BasicRewriteRule(const Pattern &leftHand, const Pattern &rightHand,
+        MatchingEngine matchingEngine = MatchingEngine::Default) :
+        leftHand(leftHand),
+        rightHand(rightHand),
+        matchingEngine(matchingEngine),
+        program(MatchingProgram::compile(leftHand)),
+        query(MatchingQuery::compile(leftHand)) {}
+
+    BasicRewriteRule(const Pattern &leftHand, Applier applier,
+        MatchingEngine matchingEngine = MatchingEngine::Default) :
+        leftHand(leftHand),
+        applier(std::move(applier)),
+        matchingEngine(matchingEngine),
+        program(MatchingProgram::compile(leftHand)),
+        query(MatchingQuery::compile(leftHand)) {}
+
+    Pattern leftHand;
+    Pattern rightHand; // not used if there's an applier
+
+    // Optional, e.g. for the explanations
+    Symbol name;
+
+    // Both optional
+    Guard guard;
+    Applier applier;
+
+    MatchingEngine matchingEngine;
+
+    // The left hand side compiled once for both matching engines,
+    // so don't change the patterns after constructing the rule
+    MatchingProgram program;
+    MatchingQuery query;
+};
+
+// The rules compiled once and then shared by any number of graphs,
+// e.g. one graph per request in a service: the set is immutable,
+// so it can be used from many threads at once, and copying it only
+// copies the pointer; the guards and the appliers, if any, are called
+// concurrently then too, so they shouldn't have any shared state
+template <typename GraphType>
+struct BasicRuleSet final
+{
+    using RewriteRule = BasicRewriteRule<GraphType>;
+
+    BasicRuleSet() :
+        rules(std::make_shared<const Vector<RewriteRule>>()) {}
+
+    explicit BasicRuleSet(Vector<RewriteRule> rules) :
+        rules(std::make_shared<const Vector<RewriteRule>>(std::move(rules))) {}
+
+    // So that it can be given to Graph::rewrite and Runner::run as is
+    operator const Vector<RewriteRule> &() const noexcept
+    {
+        return *this->rules;
+    }
+
+    const Vector<RewriteRule> &getRules() const noexcept
+    {
+        return *this->rules;
+    }
+
+    size_t size() const noexcept
+    {
+        return this->rules->size();
+    }
+
+    const RewriteRule &operator[](size_t index) const noexcept
+    {
+        return (*this->rules)[index];
+    }
+
+private:
+
+    SharedPointer<const Vector<RewriteRule>> rules;
+};
+
+struct Match final
+{
+    ClassId id1;
+    ClassId id2;
+};
+
+//------------------------------------------------------------------------------
+// E-class analyses, as in egg: each class holds some data, made for each
+// new term from its children's data, and merged when the classes are merged;
+// when it changes, the parents' data is re-made during the rebuild,
+// and then the analysis can modify the class, e.g. add a folded constant.
+// An analysis is expected to look like the one below, but do something:
+// Data should be comparable with ==, merge should return true
+// if the first argument has changed after merging the second one into it,
+// and make should get the children's data with getData, which finds the roots
+
+struct NoAnalysis final
+{
+    struct Data final
+    {
+        bool operator==(const Data &) const noexcept { return true; }
+    };
+
+    template <typename GraphType>
+    Data make(const GraphType &, const Symbol &, Span<const ClassId>)
+    {
+        return {};
+    }
+
+    bool merge(Data &, const Data &)
+    {
+        return false;
+    }
+
+    template <typename GraphType>
+    void modify(GraphType &, ClassId) {}
+};
+
+//------------------------------------------------------------------------------
+// The log of the graph's changes since some checkpoint, which can be replayed
+// onto a copy of the graph as it was at that checkpoint, e.g. see Snapshot.h;
+// only the terms actually added, the unions and the rebuilds are logged,
+// and the rebuild's own unions are not, since replaying the rebuild redoes them
+
+struct Journal final
+{
+    enum class Type : uint8_t
+    {
+        Add,
+        Unite,
+        Rebuild
+    };
+
+    struct Entry final
+    {
+        Type type;
+        Symbol name;
+        uint32_t childrenOffset = 0; // into childrenIds
+        uint32_t childrenCount = 0;
+        ClassId id1 = -1; // the new class for Add, or both sides of Unite
+        ClassId id2 = -1;
+    };
+
+    template <typename GraphType>
+    void checkpoint(const GraphType &graph)
+    {
+        static_assert(!GraphType::hasExplanations, "The proofs' own nodes can't be replayed");
+
+        this->entries.clear();
+        this->childrenIds.clear();
+        this->baseTermsCount = graph.getTermsCount();
+        this->baseClassesCount = graph.classes.size();
+    }
+
+    void logAdd(const Symbol &name, Span<const ClassId> children, ClassId classId)
+    {
+        const auto offset = uint32_t(this->childrenIds.size());
+        this->childrenIds.insert(this->childrenIds.end(), children.begin(), children.end());
+        this->entries.push_back({Type::Add, name, offset, uint32_t(children.size()), classId});
+    }
+
+    void logUnite(ClassId id1, ClassId id2)
+    {
+        this->entries.push_back({Type::Unite, {}, 0, 0, id1, id2});
+    }
+
+    void logRebuild()
+    {
+        if (!this->entries.empty() && this->entries.back().type != Type::Rebuild)
+        {
+            this->entries.push_back({Type::Rebuild, {}, 0, 0, -1, -1});
+        }
+    }
+
+    Vector<Entry> entries;
+    Vector<ClassId> childrenIds;
+
+    size_t baseTermsCount = 0;
+    size_t baseClassesCount = 0;
+};
+
+//------------------------------------------------------------------------------
+// A DAG of terms in a flat form, where each node's children are the indices
+// of some earlier nodes, e.g. to add lots of terms at once, see Graph::addDag,
+// or to get the shared terms out of the graph, see Extractor::extractDag
+
+struct TermDag final
+{
+    uint32_t addNode(const Symbol &name, Span<const uint32_t> childrenIndices)
+    {
+        const auto index = uint32_t(this->names.size());
+        assert(std::all_of(childrenIndices.begin(), childrenIndices.end(),
+            [index](uint32_t childIndex) { return childIndex < index; }));
+
+        this->names.push_back(name);
+        this->childrenIndices.insert(this->childrenIndices.end(), childrenIndices.begin(), childrenIndices.end());
+        this->childrenOffsets.push_back(uint32_t(this->childrenIndices.size()));
+        return index;
+    }
+
+    size_t size() const noexcept
+    {
+        return this->names.size();
+    }
+
+    const Symbol &getName(uint32_t index) const noexcept
+    {
+        return this->names[index];
+    }
+
+    Span<const uint32_t> getChildren(uint32_t index) const noexcept
+    {
+        const auto begin = this->childrenOffsets[index];
+        return {this->childrenIndices.data() + begin, this->childrenOffsets[index + 1] - begin};
+    }
+
+    Vector<Symbol> names;
+
+    // CSR: the children of the i-th node are between the i-th and the (i+1)-th offsets
+    Vector<uint32_t> childrenOffsets{0};
+    Vector<uint32_t> childrenIndices;
+};
+
+//------------------------------------------------------------------------------
+// Explanations, as in egg and "Proof-Producing Congruence Closure"
+// by Nieuwenhuis and Oliveras: the nodes are the terms exactly as they were
+// added, with the children as given rather than canonical, and each node
+// is also a class id; each effective union adds an edge between the two nodes
+// it was given, so that each equivalence class is also a tree of these edges,
+// and two nodes are equal because of the only path between them;
+// the edges are never removed, so once a path exists it never changes,
+// and a congruence edge is explained by the paths between the children,
+// which are all older than the edge itself, so the recursion always stops
+
+// Why the two nodes were united
+struct Justification final
+{
+    enum class Type : uint8_t
+    {
+        Given, // by hand, e.g. Graph::unite or an analysis
+        Rule,
+        Congruence
+    };
+
+    Type type = Type::Given;
+
+    // For the rules, only valid during the union
+    Symbol ruleName;
+    SymbolBindings bindings;
+};
+
+// The explanations are compiled out by default, see DefaultGraphConfig
+struct NoExplanations final {};
+
+struct ProofForest final
+{
+    // The from node's term equals the to node's term
+    struct Step final
+    {
+        ClassId from;
+        ClassId to;
+
+        Justification::Type type;
+
+        // False if the rule was applied from right to left,
+        // i.e. its left hand side matched the to node's term
+        bool isForward;
+
+        // For the rules: the left hand side instantiated with these bindings
+        // is that node's term, and the right hand side is the other one's
+        Symbol ruleName;
+        Vector<PatternVariable> variables;
+        Vector<ClassId> classIds;
+
+        // For the congruence: how each pair of the children are equal,
+        // which is empty for the same children
+        Vector<Vector<Step>> childrenSteps;
+    };
+
+    using Explanation = Vector<Step>;
+
+    // The node ids are expected to be the new class ids, see Graph::add
+    void addNode(const Symbol &name, Span<const ClassId> childrenIds, ClassId nodeId)
+    {
+        assert(ClassId(this->parents.size()) == nodeId);
+        this->parents.push_back(nodeId);
+        this->edges.emplace_back();
+
+        const auto termId = this->nodes.add(name, childrenIds);
+        assert(termId == TermId(nodeId));
+        this->nodesLookup.insert(this->nodes, termId, nodeId);
+    }
+
+    Optional<ClassId> findNode(const Symbol &name, Span<const ClassId> childrenIds) const noexcept
+    {
+        return this->nodesLookup.find(this->nodes, name, childrenIds);
+    }
+
+    // The node which added the graph's term
+    void setTermNode(TermId termId, ClassId nodeId)
+    {
+        if (this->termNodes.size() <= size_t(termId))
+        {
+            this->termNodes.resize(size_t(termId) + 1, -1);
+        }
+
+        this->termNodes[termId] = nodeId;
+    }
+
+    // The nodes of different trees are united with a new edge
+    void addEdge(ClassId from, ClassId to, const Justification &justification)
+    {
+        this->reroot(from);
+        this->parents[from] = to;
+
+        auto &edge = this->edges[from];
+        edge.from = from;
+        edge.type = justification.type;
+        edge.ruleName = justification.ruleName;
+        edge.bindingsOffset = uint32_t(this->boundVariables.size());
+        edge.bindingsCount = uint32_t(justification.bindings.variables.size());
+
+        this->boundVariables.insert(this->boundVariables.end(),
+            justification.bindings.variables.begin(), justification.bindings.variables.end());
+        this->boundClassIds.insert(this->boundClassIds.end(),
+            justification.bindings.classIds.begin(), justification.bindings.classIds.end());
+    }
+
+    ClassId getNode(TermId termId) const noexcept
+    {
+        return this->termNodes[termId];
+    }
+
+    const Symbol &getName(ClassId nodeId) const noexcept
+    {
+        return this->nodes.getName(nodeId);
+    }
+
+    Span<const ClassId> getChildren(ClassId nodeId) const noexcept
+    {
+        return this->nodes.getChildren(nodeId);
+    }
+
+    // The nodes are expected to be equal, i.e. in the same tree
+    Explanation explain(ClassId from, ClassId to) const
+    {
+        auto fromPath = this->getPathToRoot(from);
+        auto toPath = this->getPathToRoot(to);
+        assert(fromPath.back() == toPath.back());
+
+        // cut off the common part above the lowest common ancestor
+        while (fromPath.size() > 1 && toPath.size() > 1 &&
+            fromPath[fromPath.size() - 2] == toPath[toPath.size() - 2])
+        {
+            fromPath.pop_back();
+            toPath.pop_back();
+        }
+
+        Explanation result;
+        for (size_t i = 0; i + 1 < fromPath.size(); ++i)
+        {
+            result.push_back(this->makeStep(fromPath[i], fromPath[i + 1], this->edges[fromPath[i]]));
+        }
+
+        for (size_t i = toPath.size() - 1; i > 0; --i)
+        {
+            result.push_back(this->makeStep(toPath[i], toPath[i - 1], this->edges[toPath[i - 1]]));
+        }
+
+        return result;
+    }
+
+    // As an s-expression, e.g. (* a (+ b c))
+    std::string toString(ClassId nodeId) const
+    {
+        const auto childrenIds = this->getChildren(nodeId);
+        const auto &name = this->getName(nodeId).toString();
+        if (childrenIds.empty())
+        {
+            return name;
+        }
+
+        std::string result = "(" + name;
+        for (const auto &childId : childrenIds)
+        {
+            result += " " + this->toString(childId);
+        }
+
+        return result + ")";
+    }
+
+private:
+
+    struct Edge final
+    {
+        ClassId from = -1; // both ends might be swapped by reroot
+        Justification::Type type = Justification::Type::Given;
+        Symbol ruleName;
+        uint32_t bindingsOffset = 0; // into boundVariables and boundClassIds
+        uint32_t bindingsCount = 0;
+    };
+
+    // Reverses the edges on the path to the root, so that the node becomes the root
+    void reroot(ClassId nodeId)
+    {
+        auto child = nodeId;
+        auto parent = this->parents[nodeId];
+        auto edge = this->edges[nodeId];
+        this->parents[nodeId] = nodeId;
+
+        while (parent != child)
+        {
+            const auto next = this->parents[parent];
+            auto nextEdge = std::move(this->edges[parent]);
+            this->parents[parent] = child;
+            this->edges[parent] = std::move(edge);
+
+            if (next == parent)
+            {
+                break;
+            }
+
+            child = parent;
+            parent = next;
+            edge = std::move(nextEdge);
+        }
+    }
+
+    Vector<ClassId> getPathToRoot(ClassId nodeId) const
+    {
+        Vector<ClassId> result{nodeId};
+        while (this->parents[result.back()] != result.back())
+        {
+            result.push_back(this->parents[result.back()]);
+        }
+
+        return result;
+    }
+
+    Step makeStep(ClassId from, ClassId to, const Edge &edge) const
+    {
+        Step step{from, to, edge.type, edge.from == from, edge.ruleName, {}, {}, {}};
+
+        const auto bindingsBegin = this->boundVariables.begin() + edge.bindingsOffset;
+        step.variables.assign(bindingsBegin, bindingsBegin + edge.bindingsCount);
+        const auto classIdsBegin = this->boundClassIds.begin() + edge.bindingsOffset;
+        step.classIds.assign(classIdsBegin, classIdsBegin + edge.bindingsCount);
+
+        if (edge.type == Justification::Type::Congruence)
+        {
+            const auto fromChildren = this->getChildren(from);
+            const auto toChildren = this->getChildren(to);
+            assert(fromChildren.size() == toChildren.size());
+
+            step.childrenSteps.resize(fromChildren.size());
+            for (size_t i = 0; i < fromChildren.size(); ++i)
+            {
+                if (fromChildren[i] != toChildren[i])
+                {
+                    step.childrenSteps[i] = this->explain(fromChildren[i], toChildren[i]);
+                }
+            }
+        }
+
+        return step;
+    }
+
+    // Indexed by node id, the parent is the node itself for the roots,
+    // and the edge is the one to the parent
+    Vector<ClassId> parents;
+    Vector<Edge> edges;
+
+    // The node's term id is the node id, and the term's class id is too
+    TermStore nodes;
+    TermsLookup nodesLookup;
+
+    // Indexed by the graph's term id
+    Vector<ClassId> termNodes;
+
+    Vector<PatternVariable> boundVariables;
+    Vector<ClassId> boundClassIds;
+};
+
+//------------------------------------------------------------------------------
+// The statistics are collected by the hooks the graph calls on its stats,
+// e.g. see GraphStats in Stats.h, and they are compiled out by default
+
+struct NoStats final {};
+
+//------------------------------------------------------------------------------
+// E-graph
+
+// The compile-time configuration of the graph: to change some of it,
+// inherit from this one and redefine the types, e.g. see ConcurrentGraphConfig
+struct DefaultGraphConfig
+{
+    using UnionFind = e::UnionFind<ClassId>;
+    using TermStore = e::TermStore;
+    using Allocator = std::allocator<std::byte>;
+    using Analysis = NoAnalysis;
+    using Explanations = NoExplanations;
+    using Stats = NoStats;
+};
+
+// Enables the parallel rebuild, when the graph has a thread pool
+struct ConcurrentGraphConfig : DefaultGraphConfig
+{
+    using UnionFind = e::ConcurrentUnionFind<ClassId>;
+};
+
+// The classes and the operator index are allocated from the memory resource
+// given to the graph, e.g. a std::pmr::monotonic_buffer_resource per some
+// short-lived graph, which then frees them all at once: their destructors
+// still run at teardown, but they don't free anything one by one; the term
+// store, the lookup and the union-find are a few large arrays, which grow
+// geometrically, and they stay on the default allocator; note that
+// such graphs can be moved, but not assigned, since the allocators
+// don't propagate, and the classes themselves are not assignable
+struct PmrGraphConfig : DefaultGraphConfig
+{
+    using Allocator = std::pmr::polymorphic_allocator<std::byte>;
+};
+
+// For the languages with a small maximum arity, e.g. the binary operations
+// of TestLanguage, where the children can be stored inline
+template <uint32_t MaxArity>
+struct FixedArityGraphConfig : DefaultGraphConfig
+{
+    using TermStore = e::FixedArityTermStore<MaxArity>;
+};
+
+template <typename Config = DefaultGraphConfig>
+struct BasicGraph final
+{
+    using UnionFind = typename Config::UnionFind;
+    using TermStore = typename Config::TermStore;
+    using Allocator = typename Config::Allocator;
+    using Class = BasicClass<Allocator>;
+    using ClassIds = typename Class::template List<ClassId>;
+    using Analysis = typename Config::Analysis;
+    using AnalysisData = typename Analysis::Data;
+    using Explanations = typename Config::Explanations;
+    using Stats = typename Config::Stats;
+    using RewriteRule = BasicRewriteRule<BasicGraph>;
+    using RuleSet = BasicRuleSet<BasicGraph>;
+
+    // Without an analysis, all the hooks are compiled out
+    static constexpr bool hasAnalysis = !std::is_same_v<Analysis, NoAnalysis>;
+
+    // Same for the explanations, see ProofForest
+    static constexpr bool hasExplanations = !std::is_same_v<Explanations, NoExplanations>;
+
+    // And for the statistics
+    static constexpr bool hasStats = !std::is_same_v<Stats, NoStats>;
+
+    BasicGraph() = default;
+
+    // E.g. with a std::pmr::memory_resource, see PmrGraphConfig
+    explicit BasicGraph(const Allocator &allocator) :
+        classes(allocator), classesByOperator(allocator) {}
+
+    ClassId find(ClassId classId) const noexcept
+    {
+        return this->unionFind.find(classId);
+    }
+
+    ClassId addTerm(const Symbol &name)
+    {
+        return this->add(name, {});
+    }
+
+    ClassId addOperation(const Symbol &name, const Vector<ClassId> &children)
+    {
+        return this->add(name, children);
+    }
+
+    // The justification is only used for the explanations,
+    // where the classes being united are also the nodes of the proof
+    bool unite(ClassId termId1, ClassId termId2, const Justification &justification = {})
+    {
+        const auto rootId1 = this->unionFind.find(termId1);
+        const auto rootId2 = this->unionFind.find(termId2);
+
+        if constexpr (BasicGraph::hasStats)
+        {
+            this->stats.onUnite(rootId1 != rootId2);
+        }
+
+        if (rootId1 == rootId2)
+        {
+            return false;
+        }
+
+        if (this->journal != nullptr)
+        {
+            this->journal->logUnite(termId1, termId2);
+        }
+
+        if constexpr (BasicGraph::hasExplanations)
+        {
+            this->explanations.addEdge(termId1, termId2, justification);
+        }
+
+        const auto newRootId = this->unionFind.unite(rootId1, rootId2);
+        const auto oldRootId = (newRootId == rootId1) ? rootId2 : rootId1;
+
+        // the old root id is now in the operator index lists of its terms
+        for (const auto &termId : this->classes[oldRootId].terms)
+        {
+            this->dirtyOperators.push_back(this->terms.getOperator(termId));
+        }
+
+        if constexpr (BasicGraph::hasAnalysis)
+        {
+            // this is done before merging the parents lists, so that
+            // only the parents of the side whose data has changed are re-made
+            auto &newData = this->analysisData[newRootId];
+            const auto &oldData = this->analysisData[oldRootId];
+            if (this->analysis.merge(newData, oldData))
+            {
+                append(this->analysisPending, this->classes[newRootId].parents);
+            }
+
+            if (!(newData == oldData))
+            {
+                append(this->analysisPending, this->classes[oldRootId].parents);
+            }
+
+            this->analysisData[oldRootId] = {};
+            this->analysisModified.push_back(newRootId);
+        }
+
+        this->classes[newRootId].uniteWith(this->classes[oldRootId]);
+
+        if (this->tracksChanges)
+        {
+            this->changedClassIds.push_back(oldRootId);
+            this->changedClassIds.push_back(newRootId);
+        }
+
+        // the congruence closure is restored lazily, see restoreInvariants
+        this->dirtyClasses.push_back(newRootId);
+        return true;
+    }
+
+    // The deferred rebuild, as described in the egg paper: the unions only
+    // mark the merged classes as dirty, and here the parents of each dirty
+    // class are repaired once per batch, no matter how many times it was merged
+    void restoreInvariants()
+    {
+        // the rebuild is logged as a whole, see Journal
+        auto *const journal = std::exchange(this->journal, nullptr);
+
+        if constexpr (BasicGraph::hasStats)
+        {
+            this->stats.onRebuild();
+        }
+
+        // Rebuild unions
+
+        Vector<ClassId> repairedClassIds;
+
+        while (!this->dirtyClasses.empty() || this->hasPendingAnalysis())
+        {
+            Vector<ClassId> todo;
+            std::swap(todo, this->dirtyClasses);
+
+            this->unionFind.canonicalize(todo);
+            sortAndDeduplicate(todo);
+
+            if constexpr (BasicGraph::hasStats)
+            {
+                this->stats.onRepair(todo.size());
+            }
+
+            bool isRepaired = false;
+            if constexpr (UnionFind::isConcurrent)
+            {
+                if (this->threadPool != nullptr)
+                {
+                    this->repairParentsInParallel(todo, repairedClassIds);
+                    isRepaired = true;
+                }
+            }
+
+            if (!isRepaired)
+            {
+                for (const auto &classId : todo)
+                {
+                    this->repairParents(classId, repairedClassIds);
+                }
+            }
+
+            append(repairedClassIds, todo);
+
+            if constexpr (BasicGraph::hasAnalysis)
+            {
+                // this may unite more classes, so it goes on until nothing changes
+                this->repairAnalysis();
+            }
+        }
+
+        // Rebuild equivalence classes, but only the ones that changed;
+        // at this point all the terms are canonical,
+        // so this doesn't change any lookup keys' hashes
+
+        this->unionFind.canonicalize(repairedClassIds);
+        sortAndDeduplicate(repairedClassIds);
+
+        if constexpr (UnionFind::isConcurrent)
+        {
+            if (this->threadPool != nullptr)
+            {
+                // each term belongs to exactly one class,
+                // so the classes can be rebuilt independently
+                this->threadPool->parallelFor(repairedClassIds.size(), BasicGraph::parallelChunkSize,
+                    [&](size_t, size_t begin, size_t end)
+                    {
+                        for (auto i = begin; i < end; ++i)
+                        {
+                            this->classes[repairedClassIds[i]].restoreInvariants(this->unionFind, this->terms);
+                        }
+                    });
+
+                repairedClassIds.clear();
+            }
+        }
+
+        for (const auto &classId : repairedClassIds)
+        {
+            this->classes[classId].restoreInvariants(this->unionFind, this->terms);
+        }
+
+        // Rebuild the operator index, but only the lists with merged classes
+
+        sortAndDeduplicate(this->dirtyOperators);
+
+        for (const auto &dirtyOperator : this->dirtyOperators)
+        {
+            auto &classIds = this->classesByOperator[dirtyOperator];
+            this->unionFind.canonicalize(classIds);
+            sortAndDeduplicate(classIds);
+        }
+
+        this->dirtyOperators.clear();
+
+        this->journal = journal;
+        if (this->journal != nullptr)
+        {
+            this->journal->logRebuild();
+        }
+    }
+
+    // Builds the operator index from scratch, e.g. after deserialization
+    void restoreOperatorIndex()
+    {
+        this->classesByOperator.clear();
+        this->dirtyOperators.clear();
+
+        for (const auto &eClass : this->classes)
+        {
+            if (!eClass.isAlive())
+            {
+                continue;
+            }
+
+            for (const auto &termId : eClass.terms)
+            {
+                auto &classIds = this->classesByOperator[this->terms.getOperator(termId)];
+                if (classIds.empty() || classIds.back() != eClass.id)
+                {
+                    classIds.push_back(eClass.id);
+                }
+            }
+        }
+    }
+
+    // Drops everything that the merged classes and the congruent terms
+    // leave behind: the dead classes with their union-find slots, the terms
+    // which are not in the lookup anymore, and the stale parents; the classes
+    // are renumbered densely in the same order, and the result is the new id
+    // of each old class id, which is needed to update the ids kept outside,
+    // since all of them are invalid afterwards, and so are the extractors
+    Vector<ClassId> compact()
+    {
+        return this->compact([](TermId, ClassId) { return true; });
+    }
+
+    // Same, but only keeps the terms for which keepTerm(termId, classId) is true,
+    // e.g. see pruneExpensiveTerms; it gets the ids from before compacting,
+    // and each class should keep at least one of its terms
+    template <typename KeepTerm>
+    Vector<ClassId> compact(KeepTerm &&keepTerm)
+    {
+        static_assert(!BasicGraph::hasExplanations, "The proofs refer to the old class ids");
+        assert(this->dirtyClasses.empty());
+        assert(this->journal == nullptr);
+
+        Vector<ClassId> newIds(this->classes.size(), -1);
+        ClassId newClassesCount = 0;
+        for (const auto &eClass : this->classes)
+        {
+            if (eClass.isAlive())
+            {
+                newIds[eClass.id] = newClassesCount++;
+            }
+        }
+
+        for (ClassId classId = 0; classId < ClassId(newIds.size()); ++classId)
+        {
+            newIds[classId] = newIds[this->find(classId)];
+        }
+
+        // Each distinct term is copied once, since the class might still have
+        // some other congruent one; the copies are told apart by the lookup,
+        // but the copied one is always the term for which keepTerm was asked
+
+        TermStore newTerms;
+        newTerms.reserve(this->termsLookup.size(), 0);
+
+        TermsLookup newTermsLookup;
+        newTermsLookup.reserve(this->termsLookup.size());
+
+        decltype(this->classes) newClasses(this->classes.get_allocator());
+        newClasses.reserve(newClassesCount);
+
+        Vector<bool> isCopied(this->terms.size(), false);
+
+        for (const auto &eClass : this->classes)
+        {
+            if (!eClass.isAlive())
+            {
+                continue;
+            }
+
+            auto &newClass = newClasses.emplace_back(newIds[eClass.id]);
+            for (const auto &termId : eClass.terms)
+            {
+                if (!keepTerm(termId, eClass.id))
+                {
+                    continue;
+                }
+
+                const auto entry = this->termsLookup.findEntry(this->terms, termId);
+                assert(entry.has_value());
+                if (isCopied[entry->termId])
+                {
+                    continue;
+                }
+
+                this->canonicalChildrenIds.clear();
+                for (const auto &childId : this->terms.getChildren(termId))
+                {
+                    this->canonicalChildrenIds.push_back(newIds[childId]);
+                }
+
+                const auto newTermId = newTerms.add(this->terms.getName(termId), this->canonicalChildrenIds);
+                newClass.terms.push_back(newTermId);
+                newTermsLookup.insert(newTerms, newTermId, newClass.id);
+                isCopied[entry->termId] = true;
+            }
+
+            assert(!newClass.terms.empty());
+        }
+
+        // the parents lists are made from scratch, each term only once per child class
+        for (const auto &newClass : newClasses)
+        {
+            for (const auto &termId : newClass.terms)
+            {
+                const auto childrenIds = newTerms.getChildren(termId);
+                for (auto child = childrenIds.begin(); child != childrenIds.end(); ++child)
+                {
+                    if (std::find(childrenIds.begin(), child, *child) == child)
+                    {
+                        newClasses[*child].addParent(termId, newClass.id);
+                    }
+                }
+            }
+        }
+
+        if constexpr (BasicGraph::hasAnalysis)
+        {
+            Vector<AnalysisData> newAnalysisData;
+            newAnalysisData.reserve(newClassesCount);
+            for (const auto &eClass : this->classes)
+            {
+                if (eClass.isAlive())
+                {
+                    newAnalysisData.push_back(std::move(this->analysisData[eClass.id]));
+                }
+            }
+
+            this->analysisData = std::move(newAnalysisData);
+        }
+
+        Vector<ClassId> unionFindParents(newClassesCount);
+        for (ClassId classId = 0; classId < newClassesCount; ++classId)
+        {
+            unionFindParents[classId] = classId;
+        }
+
+        this->unionFind.setParents(std::move(unionFindParents));
+        // the same allocator, so this is fine even when it doesn't propagate
+        this->classes.swap(newClasses);
+        this->terms = std::move(newTerms);
+        this->termsLookup = std::move(newTermsLookup);
+        this->changedClassIds.clear();
+        this->restoreOperatorIndex();
+
+        return newIds;
+    }
+
+    void rewrite(const RewriteRule &rewriteRule)
+    {
+        const auto matches = this->search(rewriteRule);
+        this->apply(rewriteRule, matches);
+        this->restoreInvariants();
+    }
+
+    // Applies the whole rule set as one step: first all the rules are matched
+    // against the same graph, then all of the matches are applied,
+    // and then the graph is rebuilt only once
+    void rewrite(const Vector<RewriteRule> &rewriteRules)
+    {
+        Vector<Matches> matches(rewriteRules.size());
+        for (size_t i = 0; i < rewriteRules.size(); ++i)
+        {
+            this->search(rewriteRules[i], matches[i]);
+        }
+
+        for (size_t i = 0; i < rewriteRules.size(); ++i)
+        {
+            this->apply(rewriteRules[i], matches[i]);
+        }
+
+        this->restoreInvariants();
+    }
+
+    // The read phase of rewriting, it doesn't add anything to the graph;
+    // the matches buffer is cleared first, so it can be reused between calls
+    void search(const RewriteRule &rewriteRule, Matches &matches)
+    {
+        matches.clear();
+
+        const auto engine = (rewriteRule.matchingEngine == MatchingEngine::Default) ?
+            this->matchingEngine : rewriteRule.matchingEngine;
+
+        if (engine == MatchingEngine::Relational)
+        {
+            this->searchRelational(rewriteRule.query, matches);
+        }
+        else
+        {
+            this->searchMachine(rewriteRule.program, matches);
+        }
+
+        if constexpr (BasicGraph::hasStats)
+        {
+            this->stats.onSearch(rewriteRule.name, this->countCandidates(rewriteRule.program), matches.size());
+        }
+    }
+
+    // The machine only reads the graph, and it uses the const find without
+    // path compression, so the candidate classes can be split between threads
+    void searchMachine(const MatchingProgram &program, Matches &matches)
+    {
+        matches.variables = program.variables;
+
+        // if the pattern is a term, only the classes having its operator
+        // can match, otherwise all the classes are candidates
+        const ClassIds *candidateIds = nullptr;
+        if (const auto rootOperator = program.getRootOperator())
+        {
+            const auto found = this->classesByOperator.find(rootOperator.value());
+            if (found == this->classesByOperator.end())
+            {
+                return;
+            }
+
+            candidateIds = &found->second;
+        }
+
+        const auto candidatesCount = (candidateIds != nullptr) ?
+            candidateIds->size() : this->classes.size();
+
+        const auto matchCandidates = [&](size_t begin, size_t end,
+                                         Vector<ClassId> &registers, Matches &result)
+        {
+            registers.resize(program.registersCount);
+            for (auto i = begin; i < end; ++i)
+            {
+                const auto classId = (candidateIds != nullptr) ?
+                    (*candidateIds)[i] : static_cast<ClassId>(i);
+
+                if (this->classes[classId].isAlive())
+                {
+                    registers[0] = classId;
+                    this->runProgram(program, 0, registers, result);
+                }
+            }
+        };
+
+        if (this->threadPool == nullptr || candidatesCount <= BasicGraph::parallelChunkSize)
+        {
+            matchCandidates(0, candidatesCount, this->registers, matches);
+            return;
+        }
+
+        // Each chunk gets its own matches, which are then concatenated in order,
+        // so that the result is exactly the same as the single-threaded one
+
+        const auto chunksCount = (candidatesCount + BasicGraph::parallelChunkSize - 1) / BasicGraph::parallelChunkSize;
+        Vector<Matches> chunkMatches(chunksCount);
+
+        this->threadPool->parallelFor(candidatesCount, BasicGraph::parallelChunkSize,
+            [&](size_t chunk, size_t begin, size_t end)
+            {
+                Vector<ClassId> registers;
+                matchCandidates(begin, end, registers, chunkMatches[chunk]);
+            });
+
+        for (const auto &chunk : chunkMatches)
+        {
+            matches.append(chunk);
+        }
+    }
+
+    void searchRelational(const MatchingQuery &query, Matches &matches)
+    {
+        matches.variables = query.variables;
+
+        if (query.atoms.empty())
+        {
+            // the pattern is just a variable, so it matches any class;
+            // the single register is reused for all of them, as in runProgram
+            Vector<ClassId> registers(1);
+            const Vector<uint32_t> variableRegisters{0};
+            for (const auto &eClass : this->classes)
+            {
+                if (eClass.isAlive())
+                {
+                    registers[0] = eClass.id;
+                    matches.add(registers, variableRegisters, 0);
+                }
+            }
+
+            return;
+        }
+
+        GenericJoin join(query);
+
+        for (const auto &atom : query.atoms)
+        {
+            this->fillRelation(atom, join);
+        }
+
+        join.run(matches);
+    }
+
+    Matches search(const RewriteRule &rewriteRule)
+    {
+        Matches matches;
+        this->search(rewriteRule, matches);
+        return matches;
+    }
+
+    // The write phase of rewriting, it needs restoreInvariants afterwards;
+    // returns the number of unions that actually merged some classes
+    size_t apply(const RewriteRule &rewriteRule, const Matches &matches)
+    {
+        // All the right hand sides are instantiated before any unions,
+        // because this will add more classes, and the matches
+        // were found in the graph as it was before the rewrite;
+        // the left hand sides already exist, they are the matches' roots,
+        // but the explanations need the nodes of the exact terms, see add
+
+        Vector<Match> unions;
+        unions.reserve(matches.size());
+
+        Vector<Justification> justifications;
+
+        for (size_t i = 0; i < matches.size(); ++i)
+        {
+            const auto bindings = matches[i];
+            if (rewriteRule.guard && !rewriteRule.guard(bindings, *this))
+            {
+                continue;
+            }
+
+            if constexpr (BasicGraph::hasExplanations)
+            {
+                const auto leftId = this->instantiatePattern(rewriteRule.leftHand, bindings);
+                const auto rightId = rewriteRule.applier ? rewriteRule.applier(bindings, *this) :
+                    Optional<ClassId>(this->instantiatePattern(rewriteRule.rightHand, bindings));
+
+                if (rightId)
+                {
+                    unions.push_back({leftId, *rightId});
+                    justifications.push_back({Justification::Type::Rule, rewriteRule.name, bindings});
+                }
+            }
+            else if (rewriteRule.applier)
+            {
+                if (const auto rightId = rewriteRule.applier(bindings, *this))
+                {
+                    unions.push_back({bindings.root, *rightId});
+                }
+            }
+            else
+            {
+                unions.push_back({bindings.root, this->instantiatePattern(rewriteRule.rightHand, bindings)});
+            }
+        }
+
+        size_t unitedCount = 0;
+        for (size_t i = 0; i < unions.size(); ++i)
+        {
+            if constexpr (BasicGraph::hasExplanations)
+            {
+                unitedCount += this->unite(unions[i].id1, unions[i].id2, justifications[i]) ? 1 : 0;
+            }
+            else
+            {
+                unitedCount += this->unite(unions[i].id1, unions[i].id2) ? 1 : 0;
+            }
+        }
+
+        return unitedCount;
+    }
+
+    // Executes the matching program from the given instruction; the Bind
+    // instruction recursively runs the rest of the program for each term
+    void runProgram(const MatchingProgram &program, size_t pc,
+        Vector<ClassId> &registers, Matches &matches) const
+    {
+        using Type = MatchingProgram::Instruction::Type;
+
+        for (; pc < program.instructions.size(); ++pc)
+        {
+            const auto &instruction = program.instructions[pc];
+            if (instruction.type == Type::Compare)
+            {
+                if (this->find(registers[instruction.input]) !=
+                    this->find(registers[instruction.output]))
+                {
+                    return;
+                }
+
+                continue;
+            }
+
+            assert(instruction.type == Type::Bind);
+
+            const auto rootId = this->find(registers[instruction.input]);
+            assert(this->classes[rootId].isAlive());
+
+            for (const auto &termId : this->classes[rootId].terms)
+            {
+                const auto childrenIds = this->terms.getChildren(termId);
+                if (this->terms.getName(termId) != instruction.name ||
+                    childrenIds.size() != instruction.arity)
+                {
+                    continue;
+                }
+
+                std::copy(childrenIds.begin(), childrenIds.end(),
+                    registers.begin() + instruction.output);
+
+                this->runProgram(program, pc + 1, registers, matches);
+            }
+
+            return;
+        }
+
+        matches.add(registers, program.variableRegisters, 0);
+    }
+
+    ClassId instantiatePattern(const Pattern &pattern, const SymbolBindings &bindings)
+    {
+        if (const auto *subVariable = std::get_if<PatternVariable>(&pattern))
+        {
+            return this->instantiateVariable(*subVariable, bindings);
+        }
+        else if (const auto *subTerm = std::get_if<PatternTerm>(&pattern))
+        {
+            return this->instantiateOperation(*subTerm, bindings);
+        }
+
+        assert(false);
+        return -1;
+    }
+
+    ClassId instantiateVariable(const PatternVariable &variable, const SymbolBindings &bindings)
+    {
+        const auto result = bindings.find(variable);
+        assert(result);
+        return result.value();
+    }
+
+    ClassId instantiateOperation(const PatternTerm &patternTerm, const SymbolBindings &bindings)
+    {
+        // the nested calls share one stack of the children ids,
+        // so that instantiating doesn't allocate once it has grown enough
+        const auto begin = this->instantiatedIds.size();
+        for (const auto &pattern : patternTerm.arguments)
+        {
+            const auto childId = this->instantiatePattern(pattern, bindings);
+            this->instantiatedIds.push_back(childId);
+        }
+
+        const auto result = this->add(patternTerm.name,
+            {this->instantiatedIds.data() + begin, patternTerm.arguments.size()});
+
+        this->instantiatedIds.resize(begin);
+        return result;
+    }
+
+    // With the explanations, returns the node of this exact term, see ProofForest
+    ClassId add(const Symbol &name, Span<const ClassId> childrenIds)
+    {
+        if constexpr (BasicGraph::hasExplanations)
+        {
+            if (const auto nodeId = this->explanations.findNode(name, childrenIds))
+            {
+                if constexpr (BasicGraph::hasStats)
+                {
+                    this->stats.onAdd(true);
+                }
+
+                return nodeId.value();
+            }
+        }
+
+        // new terms are always added canonical, so they don't need
+        // to be repaired, unless their children get merged later
+        this->canonicalChildrenIds.clear();
+        for (const auto &childClassId : childrenIds)
+        {
+            this->canonicalChildrenIds.push_back(this->unionFind.find(childClassId));
+        }
+
+        if constexpr (BasicGraph::hasExplanations)
+        {
+            if (const auto entry = this->termsLookup.findEntry(this->terms, name, this->canonicalChildrenIds))
+            {
+                if constexpr (BasicGraph::hasStats)
+                {
+                    this->stats.onAdd(true);
+                }
+
+                return this->addCongruentNode(name, childrenIds, entry->termId);
+            }
+        }
+        else if (auto existingClassId = this->lookup(name, this->canonicalChildrenIds))
+        {
+            if constexpr (BasicGraph::hasStats)
+            {
+                this->stats.onAdd(true);
+            }
+
+            return existingClassId.value();
+        }
+
+        if constexpr (BasicGraph::hasStats)
+        {
+            this->stats.onAdd(false);
         }
 
-        assert(false);
-        return -1;
+        const auto newId = this->unionFind.addSet();
+        const auto termId = this->terms.add(name, this->canonicalChildrenIds);
+
+        for (const auto &childClassId : this->canonicalChildrenIds)
+        {
+            assert(this->classes[childClassId].isAlive());
+            this->classes[childClassId].addParent(termId, newId);
+        }
+
+        assert(static_cast<ClassId>(this->classes.size()) == newId);
+        this->classes.emplace_back(newId, termId);
+        this->termsLookup.insert(this->terms, termId, newId);
+        this->classesByOperator[this->terms.getOperator(termId)].push_back(newId);
+
+        if (this->tracksChanges)
+        {
+            this->changedClassIds.push_back(newId);
+        }
+
+        if (this->journal != nullptr)
+        {
+            this->journal->logAdd(name, this->canonicalChildrenIds, newId);
+        }
+
+        if constexpr (BasicGraph::hasExplanations)
+        {
+            this->explanations.addNode(name, childrenIds, newId);
+            this->explanations.setTermNode(termId, newId);
+        }
+
+        if constexpr (BasicGraph::hasAnalysis)
+        {
+            this->analysisData.push_back(this->analysis.make(*this, name, this->terms.getChildren(termId)));
+            this->analysis.modify(*this, newId);
+        }
+
+        return newId;
     }
 
-    ClassId instantiateVariable(const PatternVariable &variable, SymbolBindings::Ptr bindings)
+    // As in egg, the same term with other children from the same classes
+    // is a new node, but not a new term: it gets an empty class,
+    // which is united right away with the existing term's class
+    ClassId addCongruentNode(const Symbol &name, Span<const ClassId> childrenIds, TermId existingTermId)
     {
-        const auto result = bindings->find(variable);
-        assert(result);
-        return result.value();
+        const auto nodeId = this->unionFind.addSet();
+        assert(static_cast<ClassId>(this->classes.size()) == nodeId);
+        this->classes.emplace_back(nodeId);
+        this->explanations.addNode(name, childrenIds, nodeId);
+
+        if constexpr (BasicGraph::hasAnalysis)
+        {
+            this->analysisData.push_back(this->analysis.make(*this, name, this->canonicalChildrenIds));
+        }
+
+        this->unite(this->explanations.getNode(existingTermId), nodeId, {Justification::Type::Congruence, {}, {}});
+        return nodeId;
     }
 
-    ClassId instantiateOperation(const PatternTerm &patternTerm, SymbolBindings::Ptr bindings)
+    // Adds the whole DAG at once, and returns the class of each node;
+    // unlike adding the terms one by one, this reserves all the memory upfront
+    // and adds the new terms to their children's parents lists in the end,
+    // one class at a time, so that each of the lists grows only once
+    Vector<ClassId> addDag(const TermDag &dag)
     {
-        Vector<ClassId> children;
+        Vector<ClassId> result(dag.size());
 
-        for (const auto &pattern : patternTerm.arguments)
+        if constexpr (BasicGraph::hasAnalysis || BasicGraph::hasExplanations)
+        {
+            // the analysis needs the new terms to be added one by one
+            Vector<ClassId> childrenIds;
+            for (uint32_t i = 0; i < dag.size(); ++i)
+            {
+                childrenIds.clear();
+                for (const auto &childIndex : dag.getChildren(i))
+                {
+                    childrenIds.push_back(result[childIndex]);
+                }
+
+                result[i] = this->add(dag.getName(i), childrenIds);
+            }
+
+            return result;
+        }
+
+        const auto oldTermsCount = this->terms.size();
+        const auto firstNewClassId = ClassId(this->classes.size());
+        const auto maxClassesCount = this->classes.size() + dag.size();
+        this->unionFind.reserve(maxClassesCount);
+        this->classes.reserve(maxClassesCount);
+        this->terms.reserve(dag.size(), dag.childrenIndices.size());
+        this->termsLookup.reserve(this->termsLookup.size() + dag.size());
+
+        // nothing is united here, so all the class ids stay canonical
+        Vector<uint32_t> parentsCounts(maxClassesCount, 0);
+        for (uint32_t i = 0; i < dag.size(); ++i)
+        {
+            this->canonicalChildrenIds.clear();
+            for (const auto &childIndex : dag.getChildren(i))
+            {
+                this->canonicalChildrenIds.push_back(this->unionFind.find(result[childIndex]));
+            }
+
+            const auto &name = dag.getName(i);
+            const auto existingClassId = this->lookup(name, this->canonicalChildrenIds);
+
+            if constexpr (BasicGraph::hasStats)
+            {
+                this->stats.onAdd(existingClassId.has_value());
+            }
+
+            if (existingClassId)
+            {
+                result[i] = existingClassId.value();
+                continue;
+            }
+
+            const auto newId = this->unionFind.addSet();
+            const auto termId = this->terms.add(name, this->canonicalChildrenIds);
+            this->classes.emplace_back(newId, termId);
+            this->termsLookup.insert(this->terms, termId, newId);
+            this->classesByOperator[this->terms.getOperator(termId)].push_back(newId);
+
+            for (const auto &childClassId : this->canonicalChildrenIds)
+            {
+                parentsCounts[childClassId]++;
+            }
+
+            if (this->tracksChanges)
+            {
+                this->changedClassIds.push_back(newId);
+            }
+
+            if (this->journal != nullptr)
+            {
+                this->journal->logAdd(name, this->canonicalChildrenIds, newId);
+            }
+
+            result[i] = newId;
+        }
+
+        // the deferred parents bookkeeping; the new terms have the same
+        // order as their classes, so the term's class is found by its index
+        for (ClassId classId = 0; classId < ClassId(parentsCounts.size()); ++classId)
+        {
+            if (parentsCounts[classId] > 0)
+            {
+                auto &parents = this->classes[classId].parents;
+                parents.reserve(parents.size() + parentsCounts[classId]);
+            }
+        }
+
+        for (auto termId = TermId(oldTermsCount); termId < TermId(this->terms.size()); ++termId)
+        {
+            const auto classId = firstNewClassId + (termId - TermId(oldTermsCount));
+            for (const auto &childClassId : this->terms.getChildren(termId))
+            {
+                this->classes[childClassId].addParent(termId, classId);
+            }
+        }
+
+        return result;
+    }
+
+    // The analysis data of the class, see NoAnalysis
+    const AnalysisData &getData(ClassId classId) const
+    {
+        static_assert(BasicGraph::hasAnalysis, "The graph has no analysis");
+        return this->analysisData[this->find(classId)];
+    }
+
+    // Why the two classes are equal, as the steps from the first one's node
+    // to the second one's, see ProofForest; the graph doesn't need
+    // to be rebuilt, since the explanations only follow the unions
+    auto explain(ClassId classId1, ClassId classId2) const
+    {
+        static_assert(BasicGraph::hasExplanations, "The graph has no explanations");
+        assert(this->find(classId1) == this->find(classId2));
+        return this->explanations.explain(classId1, classId2);
+    }
+
+    // Returns the classes added or merged since the last call,
+    // if tracksChanges is set, e.g. see Extractor::update
+    Vector<ClassId> takeChangedClassIds()
+    {
+        Vector<ClassId> result;
+        std::swap(result, this->changedClassIds);
+        return result;
+    }
+
+    Optional<ClassId> lookup(const Symbol &name, Span<const ClassId> childrenIds) const
+    {
+        return this->termsLookup.find(this->terms, name, childrenIds);
+    }
+
+    size_t getClassesCount() const
+    {
+        return std::count_if(this->classes.begin(), this->classes.end(),
+            [](const Class &eClass) { return eClass.isAlive(); });
+    }
+
+    size_t getTermsCount() const noexcept
+    {
+        return this->terms.size();
+    }
+
+    // Roughly, in bytes, not counting the analysis data and the explanations;
+    // see getFootprint in Stats.h for the details
+    size_t getMemoryUsage() const
+    {
+        auto result = this->terms.getMemoryUsage() + this->termsLookup.getMemoryUsage() +
+            this->unionFind.getMemoryUsage() + (this->classes.capacity() - this->classes.size()) * sizeof(Class);
+
+        for (const auto &eClass : this->classes)
         {
-            children.push_back(this->instantiatePattern(pattern, bindings));
+            result += eClass.getMemoryUsage();
         }
 
-        return this->add(make<Term>(patternTerm.name, children));
+        for (const auto &[op, classIds] : this->classesByOperator)
+        {
+            result += sizeof(op) + classIds.capacity() * sizeof(ClassId);
+        }
+
+        return result;
     }
 
-    ClassId add(Term::Ptr term)
+    UnionFind unionFind;
+
+    // Class ids are dense, since they come from the union-find,
+    // so the classes are indexed by id, including the dead ones
+    typename Class::template List<Class> classes;
+
+    TermStore terms;
+
+    TermsLookup termsLookup;
+
+    // The merged classes which parents need to be repaired
+    Vector<ClassId> dirtyClasses;
+
+    // Used for the rules with the default engine
+    MatchingEngine matchingEngine = MatchingEngine::Machine;
+
+    // Optional, and not owned by the graph: if set, the machine's search phase
+    // is split between the pool's threads in chunks of the candidate classes
+    ThreadPool *threadPool = nullptr;
+
+    static constexpr size_t parallelChunkSize = 256;
+
+    // Off by default, so that nobody has to drain the changes log
+    bool tracksChanges = false;
+
+    // Optional, and not owned by the graph: if set, the changes are logged
+    // there, e.g. to write the deltas between the snapshots
+    Journal *journal = nullptr;
+
+    Analysis analysis;
+
+    Explanations explanations;
+
+    Stats stats;
+
+    // All the classes which have a term with this operator, so that
+    // the matching only starts from the classes which can actually match;
+    // after the rebuild the lists only contain unique canonical ids;
+    // like the classes' lists, these are many small allocations,
+    // so the map's nodes and the lists use the config's allocator too
+    std::unordered_map<Operator, ClassIds, Operator::Hash, std::equal_to<Operator>,
+        typename std::allocator_traits<Allocator>::template rebind_alloc<std::pair<const Operator, ClassIds>>>
+        classesByOperator;
+
+    // The operators which lists contain merged class ids
+    Vector<Operator> dirtyOperators;
+
+private:
+
+    // The state of evaluating one MatchingQuery: each atom's relation is stored
+    // as a sorted array of rows, where the columns are the atom's variables
+    // in the join order, so that once the variables before some column are bound,
+    // the rows matching them are one contiguous range, sorted by that column,
+    // which makes it a trie, and intersecting the candidates is binary search
+    struct GenericJoin final
     {
-        if (auto existingClassId = this->lookup(term))
+        struct Relation final
         {
-            return existingClassId.value();
+            Vector<uint32_t> columns;
+            Vector<ClassId> rows;
+
+            size_t size() const noexcept
+            {
+                return this->rows.size() / this->columns.size();
+            }
+
+            ClassId at(size_t row, size_t column) const noexcept
+            {
+                return this->rows[row * this->columns.size() + column];
+            }
+        };
+
+        struct Range final
+        {
+            size_t begin;
+            size_t end;
+        };
+
+        explicit GenericJoin(const MatchingQuery &query) :
+            query(query),
+            assignment(query.variablesCount, -1),
+            ranks(query.variablesCount)
+        {
+            for (uint32_t i = 0; i < query.order.size(); ++i)
+            {
+                this->ranks[query.order[i]] = i;
+            }
+        }
+
+        void run(Matches &matches)
+        {
+            const auto depth = this->query.order.size();
+            const auto relationsCount = this->relations.size();
+
+            // the ranges of each level of recursion are stored one after another
+            this->ranges.resize((depth + 1) * relationsCount);
+            for (size_t i = 0; i < relationsCount; ++i)
+            {
+                this->ranges[i] = {0, this->relations[i].size()};
+            }
+
+            this->participants.resize(depth);
+            for (size_t i = 0; i < relationsCount; ++i)
+            {
+                const auto &columns = this->relations[i].columns;
+                for (size_t c = 0; c < columns.size(); ++c)
+                {
+                    this->participants[this->ranks[columns[c]]].push_back({i, c});
+                }
+            }
+
+            this->join(0, matches);
+        }
+
+        void join(size_t depth, Matches &matches)
+        {
+            if (depth == this->query.order.size())
+            {
+                matches.add(this->assignment, this->query.variableIds, this->query.rootVariable);
+                return;
+            }
+
+            const auto relationsCount = this->relations.size();
+            const auto *current = &this->ranges[depth * relationsCount];
+            auto *next = &this->ranges[(depth + 1) * relationsCount];
+
+            // iterate the distinct values of the smallest candidates range
+            // and look each of them up in all other ranges
+
+            const auto &candidates = this->participants[depth];
+            assert(!candidates.empty());
+
+            const auto smallest = *std::min_element(candidates.begin(), candidates.end(),
+                [current](const Participant &l, const Participant &r)
+                {
+                    return current[l.relation].end - current[l.relation].begin <
+                           current[r.relation].end - current[r.relation].begin;
+                });
+
+            const auto &smallestRelation = this->relations[smallest.relation];
+            auto row = current[smallest.relation].begin;
+            while (row < current[smallest.relation].end)
+            {
+                const auto value = smallestRelation.at(row, smallest.column);
+                const auto runEnd = upperBound(smallestRelation,
+                    {row, current[smallest.relation].end}, smallest.column, value);
+
+                std::copy(current, current + relationsCount, next);
+                next[smallest.relation] = {row, runEnd};
+
+                bool found = true;
+                for (const auto &participant : candidates)
+                {
+                    if (participant.relation == smallest.relation)
+                    {
+                        continue;
+                    }
+
+                    const auto &relation = this->relations[participant.relation];
+                    const auto &range = current[participant.relation];
+                    const auto begin = lowerBound(relation, range, participant.column, value);
+                    const auto end = upperBound(relation, {begin, range.end}, participant.column, value);
+                    if (begin == end)
+                    {
+                        found = false;
+                        break;
+                    }
+
+                    next[participant.relation] = {begin, end};
+                }
+
+                if (found)
+                {
+                    this->assignment[this->query.order[depth]] = value;
+                    this->join(depth + 1, matches);
+                }
+
+                row = runEnd;
+            }
+        }
+
+        static size_t lowerBound(const Relation &relation, Range range, size_t column, ClassId value)
+        {
+            while (range.begin < range.end)
+            {
+                const auto middle = range.begin + (range.end - range.begin) / 2;
+                if (relation.at(middle, column) < value)
+                {
+                    range.begin = middle + 1;
+                }
+                else
+                {
+                    range.end = middle;
+                }
+            }
+
+            return range.begin;
+        }
+
+        static size_t upperBound(const Relation &relation, Range range, size_t column, ClassId value)
+        {
+            while (range.begin < range.end)
+            {
+                const auto middle = range.begin + (range.end - range.begin) / 2;
+                if (relation.at(middle, column) <= value)
+                {
+                    range.begin = middle + 1;
+                }
+                else
+                {
+                    range.end = middle;
+                }
+            }
+
+            return range.begin;
+        }
+
+        struct Participant final
+        {
+            size_t relation;
+            size_t column;
+        };
+
+        const MatchingQuery &query;
+
+        Vector<ClassId> assignment;
+
+        // the position of each query variable in the join order
+        Vector<uint32_t> ranks;
+
+        Vector<Relation> relations;
+
+        // the relations and their columns for each variable in the join order
+        Vector<Vector<Participant>> participants;
+
+        Vector<Range> ranges;
+    };
+
+    void fillRelation(const MatchingQuery::Atom &atom, GenericJoin &join) const
+    {
+        auto &relation = join.relations.emplace_back();
+
+        // the columns are the distinct atom's variables in the join order,
+        // and a variable repeated in the atom means the values must be equal
+        relation.columns = atom.variables;
+        sortAndDeduplicate(relation.columns);
+        std::sort(relation.columns.begin(), relation.columns.end(),
+            [&join](uint32_t l, uint32_t r) { return join.ranks[l] < join.ranks[r]; });
+
+        Vector<size_t> sources(relation.columns.size());
+        for (size_t c = 0; c < relation.columns.size(); ++c)
+        {
+            sources[c] = std::find(atom.variables.begin(), atom.variables.end(),
+                             relation.columns[c]) - atom.variables.begin();
+        }
+
+        const auto candidates = this->classesByOperator.find(atom.op);
+        if (candidates == this->classesByOperator.end())
+        {
+            return;
+        }
+
+        Vector<ClassId> tuple(atom.variables.size());
+        Vector<ClassId> rows;
+        for (const auto &classId : candidates->second)
+        {
+            for (const auto &termId : this->classes[classId].terms)
+            {
+                if (!(this->terms.getOperator(termId) == atom.op))
+                {
+                    continue;
+                }
+
+                tuple[0] = classId;
+                const auto childrenIds = this->terms.getChildren(termId);
+                std::copy(childrenIds.begin(), childrenIds.end(), tuple.begin() + 1);
+
+                bool consistent = true;
+                for (size_t i = 0; i < tuple.size() && consistent; ++i)
+                {
+                    const auto source = std::find(atom.variables.begin(), atom.variables.end(),
+                                            atom.variables[i]) - atom.variables.begin();
+                    consistent = tuple[source] == tuple[i];
+                }
+
+                if (consistent)
+                {
+                    for (const auto &source : sources)
+                    {
+                        rows.push_back(tuple[source]);
+                    }
+                }
+            }
+        }
+
+        // sort the rows, so that they form a trie, and deduplicate them
+
+        const auto stride = relation.columns.size();
+        Vector<size_t> indices(rows.size() / stride);
+        for (size_t i = 0; i < indices.size(); ++i)
+        {
+            indices[i] = i;
+        }
+
+        const auto rowLess = [&rows, stride](size_t l, size_t r)
+        {
+            return std::lexicographical_compare(rows.begin() + l * stride, rows.begin() + (l + 1) * stride,
+                rows.begin() + r * stride, rows.begin() + (r + 1) * stride);
+        };
+
+        const auto rowEquals = [&rows, stride](size_t l, size_t r)
+        {
+            return std::equal(rows.begin() + l * stride, rows.begin() + (l + 1) * stride,
+                rows.begin() + r * stride);
+        };
+
+        std::sort(indices.begin(), indices.end(), rowLess);
+        indices.erase(std::unique(indices.begin(), indices.end(), rowEquals), indices.end());
+
+        relation.rows.reserve(indices.size() * stride);
+        for (const auto &index : indices)
+        {
+            relation.rows.insert(relation.rows.end(),
+                rows.begin() + index * stride, rows.begin() + (index + 1) * stride);
+        }
+    }
+
+    void repairParents(ClassId classId, Vector<ClassId> &repairedClassIds)
+    {
+        // The parents are taken out of the class, because uniting
+        // the congruent parents may merge this very class into another one
+        auto parents = std::move(this->classes[classId].parents);
+        this->classes[classId].parents.clear();
+
+        for (auto &parent : parents)
+        {
+            // Canonicalizing the term changes its hash, so if the term
+            // is itself stored in the lookup, it is taken out and re-added
+
+            this->termsLookup.erase(this->terms, parent.termId);
+
+            this->terms.restoreInvariants(parent.termId, this->unionFind);
+
+            if (const auto cached = this->termsLookup.findEntry(this->terms, parent.termId))
+            {
+                this->uniteCongruent(cached->termId, cached->classId, parent);
+
+                // the congruent term in the lookup replaces this one, so that
+                // the terms in the lookup are always in their children's parents
+                parent.termId = cached->termId;
+            }
+            else
+            {
+                this->termsLookup.insert(this->terms, parent.termId,
+                    this->unionFind.find(parent.leafId));
+            }
+
+            repairedClassIds.push_back(parent.leafId);
+        }
+
+        // Deduplicate the parents, so that the list doesn't keep growing
+        // with the congruent terms which are already united above
+
+        std::sort(parents.begin(), parents.end(),
+            [this](const TermWithLeafId &l, const TermWithLeafId &r)
+            { return this->terms.less(l.termId, r.termId); });
+        parents.erase(std::unique(parents.begin(), parents.end(),
+                          [this](const TermWithLeafId &l, const TermWithLeafId &r)
+                          { return this->terms.equals(l.termId, r.termId); }),
+            parents.end());
+
+        append(this->classes[this->unionFind.find(classId)].parents, parents);
+    }
+
+    void uniteCongruent(TermId cachedTermId, ClassId cachedClassId, const TermWithLeafId &parent)
+    {
+        if constexpr (BasicGraph::hasExplanations)
+        {
+            // the same classes, but the proof needs the nodes of these very terms
+            this->unite(this->explanations.getNode(cachedTermId),
+                this->explanations.getNode(parent.termId), {Justification::Type::Congruence, {}, {}});
         }
         else
         {
-            const auto newId = this->unionFind.addSet();
-            auto newClass = make<Class>(newId, term);
+            this->unite(cachedClassId, parent.leafId);
+        }
+    }
+
+    // Same as repairParents for a batch of classes, but the expensive parts,
+    // canonicalizing the parent terms and deduplicating the parents lists,
+    // run on the thread pool; the lookup updates and the unions
+    // of the congruent parents stay sequential, in the same order as above,
+    // so that the resulting graph doesn't depend on the threads' timing
+    void repairParentsInParallel(const Vector<ClassId> &classIds, Vector<ClassId> &repairedClassIds)
+    {
+        Vector<typename Class::template List<TermWithLeafId>> parentsLists;
+        parentsLists.reserve(classIds.size());
+        Vector<TermId> parentTermIds;
+
+        for (size_t i = 0; i < classIds.size(); ++i)
+        {
+            // moving keeps the lists' buffers, along with their allocator
+            parentsLists.push_back(std::move(this->classes[classIds[i]].parents));
+            this->classes[classIds[i]].parents.clear();
+
+            // all the terms are erased before any of them changes its hash
+            for (const auto &parent : parentsLists[i])
+            {
+                this->termsLookup.erase(this->terms, parent.termId);
+                parentTermIds.push_back(parent.termId);
+            }
+        }
+
+        // the same term may be a parent of several classes
+        sortAndDeduplicate(parentTermIds);
 
-            for (const auto &childClassId : term->childrenIds)
+        this->threadPool->parallelFor(parentTermIds.size(), BasicGraph::parallelChunkSize,
+            [&](size_t, size_t begin, size_t end)
             {
-                const auto rootChildClassId = this->unionFind.find(childClassId);
-                assert(this->classes.find(rootChildClassId) != this->classes.end());
-                this->classes[rootChildClassId]->addParent(term, newId);
+                for (auto i = begin; i < end; ++i)
+                {
+                    this->terms.restoreInvariants(parentTermIds[i], this->unionFind);
+                }
+            });
+
+        for (auto &parents : parentsLists)
+        {
+            for (auto &parent : parents)
+            {
+                if (const auto cached = this->termsLookup.findEntry(this->terms, parent.termId))
+                {
+                    this->uniteCongruent(cached->termId, cached->classId, parent);
+                    parent.termId = cached->termId;
+                }
+                else
+                {
+                    this->termsLookup.insert(this->terms, parent.termId,
+                        this->unionFind.find(parent.leafId));
+                }
+
+                repairedClassIds.push_back(parent.leafId);
             }
+        }
 
-            this->classes[newId] = std::move(newClass);
-            this->termsLookup.insert({term, newId});
-            this->dirtyTerms.push_back({term, newId});
+        this->threadPool->parallelFor(parentsLists.size(), 1,
+            [this, &parentsLists](size_t, size_t begin, size_t end)
+            {
+                for (auto i = begin; i < end; ++i)
+                {
+                    auto &parents = parentsLists[i];
+                    std::sort(parents.begin(), parents.end(),
+                        [this](const TermWithLeafId &l, const TermWithLeafId &r)
+                        { return this->terms.less(l.termId, r.termId); });
+                    parents.erase(std::unique(parents.begin(), parents.end(),
+                                      [this](const TermWithLeafId &l, const TermWithLeafId &r)
+                                      { return this->terms.equals(l.termId, r.termId); }),
+                        parents.end());
+                }
+            });
+
+        for (size_t i = 0; i < classIds.size(); ++i)
+        {
+            append(this->classes[this->unionFind.find(classIds[i])].parents, parentsLists[i]);
+        }
+    }
 
-            return newId;
+    // The classes which the pattern's root is matched against,
+    // the same ones for both engines
+    size_t countCandidates(const MatchingProgram &program) const
+    {
+        if (const auto rootOperator = program.getRootOperator())
+        {
+            const auto found = this->classesByOperator.find(rootOperator.value());
+            return (found != this->classesByOperator.end()) ? found->second.size() : 0;
         }
+
+        return this->classes.size();
+    }
+
+    bool hasPendingAnalysis() const noexcept
+    {
+        return !this->analysisPending.empty() || !this->analysisModified.empty();
     }
 
-    Optional<ClassId> lookup(Term::Ptr term) const
+    // Re-makes the data for the parents of the classes whose data has changed,
+    // and then lets the analysis modify the changed classes
+    void repairAnalysis()
     {
-        const auto existingTerm = this->termsLookup.find(term);
-        if (existingTerm != this->termsLookup.end())
+        while (!this->analysisPending.empty())
         {
-            return existingTerm->second;
+            const auto parent = this->analysisPending.back();
+            this->analysisPending.pop_back();
+
+            const auto classId = this->unionFind.find(parent.leafId);
+            const auto data = this->analysis.make(*this,
+                this->terms.getName(parent.termId), this->terms.getChildren(parent.termId));
+
+            if (this->analysis.merge(this->analysisData[classId], data))
+            {
+                append(this->analysisPending, this->classes[classId].parents);
+                this->analysisModified.push_back(classId);
+            }
         }
 
-        return {};
+        Vector<ClassId> modifiedClassIds;
+        std::swap(modifiedClassIds, this->analysisModified);
+
+        for (auto &classId : modifiedClassIds)
+        {
+            classId = this->unionFind.find(classId);
+        }
+
+        sortAndDeduplicate(modifiedClassIds);
+
+        for (const auto &classId : modifiedClassIds)
+        {
+            this->analysis.modify(*this, this->unionFind.find(classId));
+        }
     }
 
-    UnionFind<ClassId> unionFind;
+    // The new classes and both sides of the unions, in no particular order,
+    // if tracksChanges is set, see takeChangedClassIds
+    Vector<ClassId> changedClassIds;
 
-    HashMap<ClassId, UniquePointer<Class>> classes;
+    // Indexed by class id, only meaningful for the roots
+    Vector<AnalysisData> analysisData;
 
-    HashMap<Term::Ptr, ClassId, Term::Hash> termsLookup;
+    // The parents whose data needs to be re-made, and the classes to modify
+    Vector<TermWithLeafId> analysisPending;
+    Vector<ClassId> analysisModified;
 
-    Vector<TermWithLeafId> dirtyTerms;
+    // Just buffers reused by add and search, to avoid allocating on each call
+    Vector<ClassId> canonicalChildrenIds;
+    Vector<ClassId> registers;
+    Vector<ClassId> instantiatedIds;
 };
+
+using Graph = BasicGraph<>;
+using RewriteRule = Graph::RewriteRule;
+using RuleSet = Graph::RuleSet;
+
 } // namespace e
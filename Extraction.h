@@ -0,0 +1,483 @@
+/*
+ * A simple e-graph implementation for educational purposes
+ *
+ * Copyright waived by Peter Rudenko <peter.rudenko@gmail.com>, 2023
+ *
+ * The contents of this file is free and unencumbered software released into the
+ * public domain. For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include "EGraph.h"
+
+#include <limits>
+
+namespace e
+{
+
+//------------------------------------------------------------------------------
+// Extracted terms
+
+// The extracted term as a tree, where the shared subterms are repeated
+struct ExtractedTerm final
+{
+    Symbol name;
+    Vector<ExtractedTerm> children;
+
+    // As an s-expression, e.g. (* a (+ b c))
+    std::string toString() const
+    {
+        if (this->children.empty())
+        {
+            return this->name.toString();
+        }
+
+        std::string result = "(" + this->name.toString();
+        for (const auto &child : this->children)
+        {
+            result += " " + child.toString();
+        }
+
+        return result + ")";
+    }
+};
+
+//------------------------------------------------------------------------------
+// Cost functions, computing the term's cost from its children's costs
+
+inline size_t astSize(const Symbol &, Span<const size_t> childrenCosts)
+{
+    size_t result = 1;
+    for (const auto &cost : childrenCosts)
+    {
+        result += cost;
+    }
+
+    return result;
+}
+
+inline size_t astDepth(const Symbol &, Span<const size_t> childrenCosts)
+{
+    size_t result = 0;
+    for (const auto &cost : childrenCosts)
+    {
+        result = std::max(result, cost);
+    }
+
+    return result + 1;
+}
+
+//------------------------------------------------------------------------------
+// Extractor
+
+// Picks the cheapest term of each class with a bottom-up fixpoint:
+// first all the leaves get their costs, and then a class is only revisited
+// when one of its children's classes has improved, the cheapest ones first,
+// which also works for the cyclic graphs, where the naive recursive
+// extraction wouldn't stop; the costs only need to be ordered with operator<,
+// and the cost of a term shouldn't be less than any of its children's costs,
+// and to always be extractable, it should be greater, like for the ones above
+template <typename Cost, typename GraphType = Graph>
+struct Extractor final
+{
+    using CostFunction = std::function<Cost(const Symbol &name, Span<const Cost> childrenCosts)>;
+
+    // The graph is expected to be rebuilt, see Graph::restoreInvariants;
+    // the costs are computed here, and then only updated explicitly, see update
+    Extractor(const GraphType &graph, CostFunction costFunction) :
+        graph(graph), costFunction(std::move(costFunction))
+    {
+        this->computeCosts();
+    }
+
+    // Brings the costs up to date after the graph has changed,
+    // given all the classes it has added or merged since then, which
+    // the graph tracks if asked to, see Graph::takeChangedClassIds;
+    // the terms are never removed, so the costs can only improve,
+    // and only the changed classes and their ancestors are revisited;
+    // if the graph doesn't track the changes, all costs are recomputed
+    void update(const Vector<ClassId> &changedClassIds)
+    {
+        assert(this->graph.dirtyClasses.empty());
+
+        if (!this->graph.tracksChanges)
+        {
+            assert(changedClassIds.empty());
+            this->computeCosts();
+            return;
+        }
+
+        this->bests.resize(this->graph.classes.size());
+
+        Vector<ClassId> changedRootIds;
+        Vector<bool> isChanged(this->graph.classes.size(), false);
+
+        for (const auto &classId : changedClassIds)
+        {
+            const auto rootId = this->graph.find(classId);
+            if (rootId != classId && this->bests[classId])
+            {
+                // the merged class' best term is now one of the root's candidates
+                auto &rootBest = this->bests[rootId];
+                if (!rootBest || this->bests[classId]->cost < rootBest->cost)
+                {
+                    rootBest = std::move(this->bests[classId]);
+                }
+
+                this->bests[classId].reset();
+            }
+
+            if (!isChanged[rootId])
+            {
+                isChanged[rootId] = true;
+                changedRootIds.push_back(rootId);
+            }
+        }
+
+        Vector<Queued> queue;
+        for (const auto &classId : changedRootIds)
+        {
+            for (const auto &termId : this->graph.classes[classId].terms)
+            {
+                this->tryImprove(termId, classId);
+            }
+
+            this->enqueue(queue, classId);
+        }
+
+        this->propagate(queue);
+    }
+
+    Optional<Cost> getCost(ClassId classId) const
+    {
+        const auto &best = this->bests[this->graph.find(classId)];
+        return best ? Optional<Cost>(best->cost) : Optional<Cost>();
+    }
+
+    Optional<TermId> getBestTerm(ClassId classId) const
+    {
+        const auto &best = this->bests[this->graph.find(classId)];
+        return best ? Optional<TermId>(best->termId) : Optional<TermId>();
+    }
+
+    // The cost of the term made of its children's best terms,
+    // or nothing if some of them can't be extracted
+    Optional<Cost> getTermCost(TermId termId) const
+    {
+        Vector<Cost> termChildrenCosts;
+        return this->computeCost(termId, termChildrenCosts);
+    }
+
+    // The shared subterms are repeated, so this is for the small terms,
+    // but it doesn't recurse, since even those can be deep; returns nothing
+    // in the same cases as extractDag, which it is made from
+    Optional<ExtractedTerm> extractTerm(ClassId classId) const
+    {
+        const auto dag = this->extractDag(classId);
+        if (!dag)
+        {
+            return {};
+        }
+
+        ExtractedTerm result;
+
+        Vector<std::pair<ExtractedTerm *, uint32_t>> stack{{&result, uint32_t(dag->size() - 1)}};
+        while (!stack.empty())
+        {
+            const auto [extractedTerm, nodeIndex] = stack.back();
+            stack.pop_back();
+
+            const auto childrenIndices = dag->getChildren(nodeIndex);
+            extractedTerm->name = dag->getName(nodeIndex);
+
+            // sized before taking the pointers, so that they stay valid
+            extractedTerm->children.resize(childrenIndices.size());
+            for (size_t i = 0; i < childrenIndices.size(); ++i)
+            {
+                stack.push_back({&extractedTerm->children[i], childrenIndices[i]});
+            }
+        }
+
+        return result;
+    }
+
+    // Each class appears only once, and the root is the last node;
+    // the classes are visited depth-first with an explicit stack,
+    // since the extracted DAGs can be thousands of levels deep;
+    // returns nothing if the class has no extractable term, see getCost,
+    // or if the best terms form a cycle, which can only happen when
+    // some term costs the same as one of its children
+    Optional<TermDag> extractDag(ClassId classId) const
+    {
+        TermDag result;
+
+        // the classes on the stack are marked, so that a cycle is detected
+        constexpr auto onStack = std::numeric_limits<uint32_t>::max();
+        HashMap<ClassId, uint32_t> nodeIndices;
+
+        struct Frame final
+        {
+            ClassId classId;
+            TermId termId;
+            size_t nextChild;
+        };
+
+        Vector<Frame> stack;
+        Vector<uint32_t> childrenIndices;
+
+        const auto push = [this, &stack, &nodeIndices](ClassId rootId)
+        {
+            const auto termId = this->getBestTerm(rootId);
+            if (!termId)
+            {
+                return false;
+            }
+
+            nodeIndices[rootId] = onStack;
+            stack.push_back({rootId, *termId, 0});
+            return true;
+        };
+
+        if (!push(this->graph.find(classId)))
+        {
+            return {};
+        }
+
+        while (!stack.empty())
+        {
+            auto &frame = stack.back();
+            const auto childrenIds = this->graph.terms.getChildren(frame.termId);
+
+            if (frame.nextChild < childrenIds.size())
+            {
+                const auto childId = this->graph.find(childrenIds[frame.nextChild++]);
+                if (const auto found = nodeIndices.find(childId); found == nodeIndices.end())
+                {
+                    if (!push(childId)) // invalidates the frame
+                    {
+                        return {};
+                    }
+                }
+                else if (found->second == onStack)
+                {
+                    return {};
+                }
+
+                continue;
+            }
+
+            childrenIndices.clear();
+            for (const auto &childId : childrenIds)
+            {
+                childrenIndices.push_back(nodeIndices.at(this->graph.find(childId)));
+            }
+
+            nodeIndices[frame.classId] = result.addNode(this->graph.terms.getName(frame.termId), childrenIndices);
+            stack.pop_back();
+        }
+
+        return result;
+    }
+
+private:
+
+    void computeCosts()
+    {
+        assert(this->graph.dirtyClasses.empty());
+
+        this->bests.assign(this->graph.classes.size(), {});
+
+        Vector<Queued> queue;
+
+        for (const auto &eClass : this->graph.classes)
+        {
+            if (!eClass.isAlive())
+            {
+                continue;
+            }
+
+            for (const auto &termId : eClass.terms)
+            {
+                if (this->graph.terms.getChildren(termId).empty())
+                {
+                    this->tryImprove(termId, eClass.id);
+                }
+            }
+
+            this->enqueue(queue, eClass.id);
+        }
+
+        this->propagate(queue);
+    }
+
+    // The classes are taken cheapest first, like in Dijkstra's algorithm,
+    // so with the costs not less than their children's ones each class
+    // is final by the time it is taken, and its parents are visited once;
+    // the LIFO order would instead re-propagate every improvement
+    // up the long parent chains of the deep DAGs, which is quadratic
+    struct Queued final
+    {
+        Cost cost;
+        ClassId classId;
+    };
+
+    static bool isMoreExpensive(const Queued &l, const Queued &r)
+    {
+        return r.cost < l.cost;
+    }
+
+    void enqueue(Vector<Queued> &queue, ClassId classId) const
+    {
+        if (const auto &best = this->bests[classId])
+        {
+            queue.push_back({best->cost, classId});
+            std::push_heap(queue.begin(), queue.end(), Extractor::isMoreExpensive);
+        }
+    }
+
+    // Every term is in its children's parents lists,
+    // so the improvements propagate up through the parents only
+    void propagate(Vector<Queued> &queue)
+    {
+        while (!queue.empty())
+        {
+            std::pop_heap(queue.begin(), queue.end(), Extractor::isMoreExpensive);
+            const auto queued = std::move(queue.back());
+            queue.pop_back();
+
+            // the class has improved since it was queued, and is queued again
+            if (this->bests[queued.classId]->cost < queued.cost)
+            {
+                continue;
+            }
+
+            for (const auto &parent : this->graph.classes[queued.classId].parents)
+            {
+                const auto parentClassId = this->graph.find(parent.leafId);
+                if (this->tryImprove(parent.termId, parentClassId))
+                {
+                    this->enqueue(queue, parentClassId);
+                }
+            }
+        }
+    }
+
+    Optional<Cost> computeCost(TermId termId, Vector<Cost> &termChildrenCosts) const
+    {
+        termChildrenCosts.clear();
+        for (const auto &childId : this->graph.terms.getChildren(termId))
+        {
+            const auto &childBest = this->bests[this->graph.find(childId)];
+            if (!childBest)
+            {
+                return {};
+            }
+
+            termChildrenCosts.push_back(childBest->cost);
+        }
+
+        return this->costFunction(this->graph.terms.getName(termId), termChildrenCosts);
+    }
+
+    // Returns true if the term is now the best one in its class
+    bool tryImprove(TermId termId, ClassId classId)
+    {
+        auto cost = this->computeCost(termId, this->childrenCosts);
+        if (!cost)
+        {
+            return false;
+        }
+
+        auto &best = this->bests[classId];
+        if (best && !(*cost < best->cost))
+        {
+            return false;
+        }
+
+        best = Best{std::move(*cost), termId};
+        return true;
+    }
+
+    struct Best final
+    {
+        Cost cost;
+        TermId termId;
+    };
+
+    const GraphType &graph;
+
+    const CostFunction costFunction;
+
+    // indexed by class id, only meaningful for the roots
+    Vector<Optional<Best>> bests;
+
+    // just a buffer reused by tryImprove
+    Vector<Cost> childrenCosts;
+};
+
+//------------------------------------------------------------------------------
+// Pruning
+
+// Drops all but the few cheapest terms of each class, e.g. once the graph
+// is over some memory budget, see Runner::pruner; the best terms are kept,
+// so the extracted terms stay the same, and the classes without any
+// extractable term are kept as they are; this compacts the graph,
+// see Graph::compact, which makes the extractor invalid, and returns
+// the new class ids the same way
+template <typename Cost, typename GraphType>
+Vector<ClassId> pruneExpensiveTerms(GraphType &graph,
+    const Extractor<Cost, GraphType> &extractor, size_t termsPerClass = 1)
+{
+    assert(termsPerClass > 0);
+
+    Vector<bool> isKept(graph.getTermsCount(), false);
+    Vector<std::pair<Cost, TermId>> candidates;
+
+    for (const auto &eClass : graph.classes)
+    {
+        if (!eClass.isAlive())
+        {
+            continue;
+        }
+
+        const auto bestTermId = extractor.getBestTerm(eClass.id);
+        if (!bestTermId)
+        {
+            for (const auto &termId : eClass.terms)
+            {
+                isKept[termId] = true;
+            }
+
+            continue;
+        }
+
+        candidates.clear();
+        for (const auto &termId : eClass.terms)
+        {
+            // the best term found via the parents might be another copy of it
+            if (graph.terms.equals(termId, *bestTermId))
+            {
+                isKept[termId] = true;
+                continue;
+            }
+
+            if (auto cost = extractor.getTermCost(termId))
+            {
+                candidates.push_back({std::move(*cost), termId});
+            }
+        }
+
+        const auto othersCount = std::min(termsPerClass - 1, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + othersCount, candidates.end(),
+            [](const auto &l, const auto &r) { return l.first < r.first; });
+
+        for (size_t i = 0; i < othersCount; ++i)
+        {
+            isKept[candidates[i].second] = true;
+        }
+    }
+
+    return graph.compact([&isKept](TermId termId, ClassId) { return isKept[termId]; });
+}
+} // namespace e
@@ -0,0 +1,354 @@
+/*
+ * A simple e-graph implementation for educational purposes
+ *
+ * Copyright waived by Peter Rudenko <peter.rudenko@gmail.com>, 2023
+ *
+ * The contents of this file is free and unencumbered software released into the
+ * public domain. For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include "EGraph.h"
+
+#include <chrono>
+#include <functional>
+#include <limits>
+
+namespace e
+{
+
+//------------------------------------------------------------------------------
+// Equality saturation: keep rewriting until nothing changes or some limit is hit
+
+struct SaturationLimits final
+{
+    size_t iterations = 30;
+    size_t terms = 10000;
+    size_t classes = 10000;
+    std::chrono::milliseconds time = std::chrono::seconds(5);
+
+    // In bytes, see Graph::getMemoryUsage, and no limit by default
+    size_t memory = std::numeric_limits<size_t>::max();
+};
+
+enum class StopReason
+{
+    Saturated,
+    IterationLimit,
+    TermLimit,
+    ClassLimit,
+    TimeLimit,
+    MemoryLimit
+};
+
+struct SaturationReport final
+{
+    StopReason stopReason = StopReason::Saturated;
+    size_t iterations = 0;
+    std::chrono::nanoseconds elapsed{0};
+};
+
+//------------------------------------------------------------------------------
+// Rule schedulers decide which rules' matches are applied at each iteration
+
+struct Scheduler
+{
+    virtual ~Scheduler() = default;
+
+    // Called before searching the rule, returns false to skip it this iteration
+    virtual bool canSearch(size_t iteration, size_t ruleIndex) = 0;
+
+    // Called with the rule's matches before applying them,
+    // returns false to skip them; the matches can also be modified here
+    virtual bool canApply(size_t iteration, size_t ruleIndex, Matches &matches) = 0;
+
+    // Called when an iteration hasn't changed anything,
+    // returns false if the saturation shouldn't stop yet
+    virtual bool canStop(size_t iteration) = 0;
+};
+
+// Just applies all the matches of all the rules every iteration
+struct SimpleScheduler final : Scheduler
+{
+    bool canSearch(size_t, size_t) override
+    {
+        return true;
+    }
+
+    bool canApply(size_t, size_t, Matches &) override
+    {
+        return true;
+    }
+
+    bool canStop(size_t) override
+    {
+        return true;
+    }
+};
+
+// A scheduler which bans the rules that match too much, the same way egg does:
+// once the rule's matches exceed its limit, the rule gets banned for some
+// iterations, and each next time both the limit and the ban length are doubled,
+// so that the explosive rules like commutativity can't dominate all iterations
+struct BackoffScheduler final : Scheduler
+{
+    struct RuleStats final
+    {
+        size_t timesApplied = 0;
+        size_t timesBanned = 0;
+        size_t bannedUntil = 0;
+        size_t lastMatchesCount = 0;
+    };
+
+    explicit BackoffScheduler(size_t matchLimit = 1000, size_t banLength = 5) :
+        matchLimit(matchLimit), banLength(banLength) {}
+
+    bool canSearch(size_t iteration, size_t ruleIndex) override
+    {
+        if (ruleIndex >= this->stats.size())
+        {
+            this->stats.resize(ruleIndex + 1);
+        }
+
+        return iteration >= this->stats[ruleIndex].bannedUntil;
+    }
+
+    bool canApply(size_t iteration, size_t ruleIndex, Matches &matches) override
+    {
+        auto &ruleStats = this->stats[ruleIndex];
+        ruleStats.lastMatchesCount = matches.size();
+
+        const auto threshold = saturatingShift(this->matchLimit, ruleStats.timesBanned);
+        if (matches.size() > threshold)
+        {
+            const auto currentBanLength = saturatingShift(this->banLength, ruleStats.timesBanned);
+            ruleStats.timesBanned++;
+            ruleStats.bannedUntil = iteration + std::min(currentBanLength,
+                std::numeric_limits<size_t>::max() - iteration);
+            return false;
+        }
+
+        ruleStats.timesApplied++;
+        return true;
+    }
+
+    bool canStop(size_t iteration) override
+    {
+        // nothing has changed, but some rules might be banned,
+        // so instead of stopping, bring the nearest ban end to now
+        size_t nearestBanEnd = std::numeric_limits<size_t>::max();
+        for (const auto &ruleStats : this->stats)
+        {
+            if (ruleStats.bannedUntil > iteration)
+            {
+                nearestBanEnd = std::min(nearestBanEnd, ruleStats.bannedUntil);
+            }
+        }
+
+        if (nearestBanEnd == std::numeric_limits<size_t>::max())
+        {
+            return true;
+        }
+
+        const auto delta = nearestBanEnd - iteration;
+        for (auto &ruleStats : this->stats)
+        {
+            if (ruleStats.bannedUntil > iteration)
+            {
+                ruleStats.bannedUntil -= delta;
+            }
+        }
+
+        return false;
+    }
+
+    // Indexed the same way as the rules passed to the runner
+    const Vector<RuleStats> &getStats() const noexcept
+    {
+        return this->stats;
+    }
+
+private:
+
+    // The doubling is capped at the maximum instead of overflowing,
+    // like egg does, since a rule can keep exploding for a long run
+    static size_t saturatingShift(size_t value, size_t shift) noexcept
+    {
+        constexpr auto max = std::numeric_limits<size_t>::max();
+        if (value == 0)
+        {
+            return 0;
+        }
+
+        if (shift >= size_t(std::numeric_limits<size_t>::digits) || value > (max >> shift))
+        {
+            return max;
+        }
+
+        return value << shift;
+    }
+
+    const size_t matchLimit;
+    const size_t banLength;
+
+    Vector<RuleStats> stats;
+};
+
+//------------------------------------------------------------------------------
+// The runner itself
+
+template <typename GraphType = Graph>
+struct Runner final
+{
+    explicit Runner(GraphType &graph, const SaturationLimits &limits = {}) :
+        graph(graph), limits(limits) {}
+
+    SaturationReport run(const Vector<typename GraphType::RewriteRule> &rewriteRules)
+    {
+        SimpleScheduler scheduler;
+        return this->run(rewriteRules, scheduler);
+    }
+
+    SaturationReport run(const Vector<typename GraphType::RewriteRule> &rewriteRules, Scheduler &scheduler)
+    {
+        const auto startTime = Clock::now();
+
+        // the graph might have been modified before running, so it's rebuilt first
+        this->graph.restoreInvariants();
+
+        // the matches buffers are reused between iterations
+        Vector<Matches> matches(rewriteRules.size());
+
+        SaturationReport report;
+        for (;;)
+        {
+            if (this->pruner && this->isOverMemoryLimit())
+            {
+                this->pruner(this->graph);
+            }
+
+            report.elapsed = Clock::now() - startTime;
+            if (const auto limitReason = this->checkLimits(report))
+            {
+                report.stopReason = limitReason.value();
+                return report;
+            }
+
+            // one iteration is like Graph::rewrite for the whole rule set,
+            // but the scheduler decides which rules are searched and applied
+
+            const auto searchStartTime = Runner::now();
+
+            for (size_t i = 0; i < rewriteRules.size(); ++i)
+            {
+                matches[i].clear();
+                if (scheduler.canSearch(report.iterations, i))
+                {
+                    this->graph.search(rewriteRules[i], matches[i]);
+                    if (!scheduler.canApply(report.iterations, i, matches[i]))
+                    {
+                        matches[i].clear();
+                    }
+                }
+            }
+
+            const auto applyStartTime = Runner::now();
+
+            size_t unitedCount = 0;
+            for (size_t i = 0; i < rewriteRules.size(); ++i)
+            {
+                unitedCount += this->graph.apply(rewriteRules[i], matches[i]);
+            }
+
+            const auto rebuildStartTime = Runner::now();
+
+            this->graph.restoreInvariants();
+
+            if constexpr (GraphType::hasStats)
+            {
+                size_t matchesCount = 0;
+                for (const auto &ruleMatches : matches)
+                {
+                    matchesCount += ruleMatches.size();
+                }
+
+                this->graph.stats.onIteration({report.iterations,
+                    searchStartTime, applyStartTime, rebuildStartTime, Runner::now(),
+                    matchesCount, unitedCount, this->graph.getClassesCount(), this->graph.getTermsCount()});
+            }
+
+            report.iterations++;
+
+            if (unitedCount == 0 && scheduler.canStop(report.iterations))
+            {
+                report.elapsed = Clock::now() - startTime;
+                report.stopReason = StopReason::Saturated;
+                return report;
+            }
+        }
+    }
+
+    // Optional: called with the rebuilt graph when it is over the memory limit,
+    // e.g. to prune it with pruneExpensiveTerms, and then the saturation
+    // only stops if the graph is still over the limit
+    std::function<void(GraphType &graph)> pruner;
+
+private:
+
+    using Clock = std::chrono::steady_clock;
+
+    bool isOverMemoryLimit() const
+    {
+        return this->limits.memory != std::numeric_limits<size_t>::max() &&
+            this->graph.getMemoryUsage() > this->limits.memory;
+    }
+
+    // The phases are only timed for the statistics
+    static Clock::time_point now()
+    {
+        if constexpr (GraphType::hasStats)
+        {
+            return Clock::now();
+        }
+        else
+        {
+            return {};
+        }
+    }
+
+    Optional<StopReason> checkLimits(const SaturationReport &report) const
+    {
+        if (report.iterations >= this->limits.iterations)
+        {
+            return StopReason::IterationLimit;
+        }
+
+        if (this->graph.getTermsCount() > this->limits.terms)
+        {
+            return StopReason::TermLimit;
+        }
+
+        if (this->graph.getClassesCount() > this->limits.classes)
+        {
+            return StopReason::ClassLimit;
+        }
+
+        if (report.elapsed > this->limits.time)
+        {
+            return StopReason::TimeLimit;
+        }
+
+        if (this->isOverMemoryLimit())
+        {
+            return StopReason::MemoryLimit;
+        }
+
+        return {};
+    }
+
+    GraphType &graph;
+
+    const SaturationLimits limits;
+};
+} // namespace e
@@ -29,14 +29,13 @@ struct GraphDTO final
 
     struct Term final
     {
-        Id leafId;
-        Symbol name;
+        std::string name; // symbol ids are only valid within one process
         Vector<Id> childrenIds;
 
         template <typename Archive>
         void serialize(Archive &archive)
         {
-            archive(this->leafId, this->name, this->childrenIds);
+            archive(this->name, this->childrenIds);
         }
     };
 
@@ -44,49 +43,63 @@ struct GraphDTO final
     {
         Id classId;
         Vector<Id> termIds;
-        Vector<Id> parentIds;
+        Vector<Id> parentTermIds;
+        Vector<Id> parentLeafIds;
 
         template <typename Archive>
         void serialize(Archive &archive)
         {
-            archive(this->classId, this->termIds, this->parentIds);
+            archive(this->classId, this->termIds, this->parentTermIds, this->parentLeafIds);
         }
     };
 
-    Vector<Id> unionFind;
-    Vector<Term> terms;
+    Vector<Id> unionFind; // the sizes or ranks are recomputed when loading
+    Vector<Term> terms; // indexed by term id
+    Vector<Id> lookupTermIds;
+    Vector<Id> lookupClassIds;
     Vector<Class> classes;
 
     template <typename Archive>
     void serialize(Archive &archive)
     {
-        archive(this->unionFind, this->terms, this->classes);
+        archive(this->unionFind, this->terms,
+            this->lookupTermIds, this->lookupClassIds, this->classes);
     }
 };
 
-static std::string serialize(const Graph &eGraph)
+template <typename Config>
+static std::string serialize(const BasicGraph<Config> &eGraph)
 {
     GraphDTO dto;
-    dto.unionFind = eGraph.unionFind.parents;
+    dto.unionFind = eGraph.unionFind.getParents();
 
-    for (const auto &[termPtr, leafId] : eGraph.termsLookup)
+    for (TermId termId = 0; termId < TermId(eGraph.terms.size()); ++termId)
     {
-        dto.terms.push_back({leafId, termPtr->name, termPtr->childrenIds});
+        dto.terms.push_back({eGraph.terms.getName(termId).toString(),
+            eGraph.terms.getChildren(termId).toVector()});
     }
 
-    for (const auto &[classId, classPtr] : eGraph.classes)
+    eGraph.termsLookup.forEach([&dto](TermId termId, ClassId classId)
     {
-        GraphDTO::Class c;
-        c.classId = classId;
+        dto.lookupTermIds.push_back(termId);
+        dto.lookupClassIds.push_back(classId);
+    });
 
-        for (const auto &term : classPtr->terms)
+    for (const auto &eClass : eGraph.classes)
+    {
+        if (!eClass.isAlive())
         {
-            c.termIds.push_back(eGraph.termsLookup.at(term));
+            continue;
         }
 
-        for (const auto &parent : classPtr->parents)
+        GraphDTO::Class c;
+        c.classId = eClass.id;
+        c.termIds = eClass.terms;
+
+        for (const auto &parent : eClass.parents)
         {
-            c.parentIds.push_back(eGraph.termsLookup.at(parent.term));
+            c.parentTermIds.push_back(parent.termId);
+            c.parentLeafIds.push_back(parent.leafId);
         }
 
         dto.classes.push_back(std::move(c));
@@ -102,7 +115,8 @@ static std::string serialize(const Graph &eGraph)
     return stream.str();
 }
 
-static Graph deserialize(const std::string &data)
+template <typename GraphType = Graph>
+static GraphType deserialize(const std::string &data)
 {
     GraphDTO dto;
 
@@ -112,37 +126,50 @@ static Graph deserialize(const std::string &data)
         deserializer(dto);
     }
 
-    Graph eGraph;
-    eGraph.unionFind.parents = move(dto.unionFind);
+    static_assert(!GraphType::hasAnalysis, "The analysis data is not serialized");
+    static_assert(!GraphType::hasExplanations, "The proofs are not serialized");
 
-    HashMap<ClassId, Term::Ptr> termsLookup;
+    GraphType eGraph;
+    eGraph.unionFind.setParents(move(dto.unionFind));
 
     for (const auto &term : dto.terms)
     {
-        Term::Ptr termPtr = make<Term>(term.name, term.childrenIds);
-        eGraph.termsLookup[termPtr] = term.leafId;
-        termsLookup[term.leafId] = termPtr;
+        eGraph.terms.add(term.name, term.childrenIds);
     }
 
-    for (const auto &cls : dto.classes)
+    assert(dto.lookupTermIds.size() == dto.lookupClassIds.size());
+    for (size_t i = 0; i < dto.lookupTermIds.size(); ++i)
     {
-        auto eClass = make<Class>(cls.classId);
+        eGraph.termsLookup.insert(eGraph.terms, dto.lookupTermIds[i], dto.lookupClassIds[i]);
+    }
 
-        for (const auto &leafId : cls.termIds)
+    // only the live classes are serialized, i.e. the union-find roots,
+    // and the rest of the class slots are tombstones
+    eGraph.classes.reserve(eGraph.unionFind.size());
+    for (ClassId classId = 0; classId < ClassId(eGraph.unionFind.size()); ++classId)
+    {
+        auto &eClass = eGraph.classes.emplace_back(classId);
+        if (eGraph.unionFind.find(classId) != classId)
         {
-            assert(termsLookup.find(leafId) != termsLookup.end());
-            eClass->terms.push_back(termsLookup[leafId]);
+            eClass.makeTombstone();
         }
+    }
+
+    for (const auto &cls : dto.classes)
+    {
+        auto &eClass = eGraph.classes[cls.classId];
+        assert(eClass.isAlive());
+        eClass.terms = cls.termIds;
 
-        for (const auto &leafId : cls.parentIds)
+        assert(cls.parentTermIds.size() == cls.parentLeafIds.size());
+        for (size_t i = 0; i < cls.parentTermIds.size(); ++i)
         {
-            assert(termsLookup.find(leafId) != termsLookup.end());
-            eClass->parents.push_back({termsLookup[leafId], leafId});
+            eClass.addParent(cls.parentTermIds[i], cls.parentLeafIds[i]);
         }
-
-        eGraph.classes[cls.classId] = move(eClass);
     }
 
+    eGraph.restoreOperatorIndex();
+
     return eGraph;
 }
 } // namespace e
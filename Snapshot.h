@@ -0,0 +1,886 @@
+/*
+ * A simple e-graph implementation for educational purposes
+ *
+ * Copyright waived by Peter Rudenko <peter.rudenko@gmail.com>, 2023
+ *
+ * The contents of this file is free and unencumbered software released into the
+ * public domain. For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include "EGraph.h"
+
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <ostream>
+#include <string_view>
+
+#if __has_include(<sys/mman.h>)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define EGRAPH_HAS_POSIX 1
+#endif
+
+// A flat binary snapshot of the graph, the alternative to Serialization.h
+// that needs no dependencies and does no per-term allocations or string copies:
+// it's just a few arrays of 32-bit words, laid out one after another,
+// so it is written at once, and can be read in place, e.g. from a mapped file.
+// All arrays are in the native byte order, and each one starts 4-byte aligned:
+//
+//  header                      SnapshotHeader
+//  symbol offsets              [symbolsCount + 1], into the symbol chars
+//  symbol chars                [charsCount], padded to whole words
+//  terms                       [termsCount * 3]: symbol index, children offset and count
+//  children                    [childrenCount], the class ids of all terms' children
+//  union-find parents          [classesCount]
+//  class terms offsets         [classesCount + 1], into the class terms
+//  class terms                 [classTermsCount]
+//  class parents offsets       [classesCount + 1], into the class parents
+//  class parents               [parentsCount * 2]: term id and leaf class id
+//  lookup                      [lookupCount * 2]: term id and class id
+
+// The deltas are the journals of changes since some snapshot, see Journal,
+// in the same kind of layout:
+//
+//  header                      DeltaHeader
+//  symbol offsets              [symbolsCount + 1], into the symbol chars
+//  symbol chars                [charsCount], padded to whole words
+//  entries                     [entriesWordsCount], one after another:
+//                              Add: type, symbol index, new class id, children count, children...
+//                              Unite: type, first class id, second class id
+//                              Rebuild: type
+
+namespace e
+{
+
+struct SnapshotHeader final
+{
+    static constexpr uint32_t expectedMagic = 0x4e534745; // "EGSN"
+    static constexpr uint32_t expectedVersion = 1;
+
+    uint32_t magic = expectedMagic;
+    uint32_t version = expectedVersion;
+
+    uint32_t symbolsCount = 0;
+    uint32_t charsCount = 0;
+    uint32_t termsCount = 0;
+    uint32_t childrenCount = 0;
+    uint32_t classesCount = 0;
+    uint32_t classTermsCount = 0;
+    uint32_t parentsCount = 0;
+    uint32_t lookupCount = 0;
+
+    // The total size of the snapshot, including the header;
+    // counted in size_t, since the arrays of the big graphs don't fit 32 bits
+    size_t getWordsCount() const noexcept
+    {
+        return sizeof(SnapshotHeader) / sizeof(uint32_t) +
+               (size_t(this->symbolsCount) + 1) + (size_t(this->charsCount) + 3) / 4 +
+               size_t(this->termsCount) * 3 + this->childrenCount +
+               this->classesCount + (size_t(this->classesCount) + 1) + this->classTermsCount +
+               (size_t(this->classesCount) + 1) + size_t(this->parentsCount) * 2 + size_t(this->lookupCount) * 2;
+    }
+};
+
+static_assert(sizeof(SnapshotHeader) % sizeof(uint32_t) == 0);
+
+struct DeltaHeader final
+{
+    static constexpr uint32_t expectedMagic = 0x4c444745; // "EGDL"
+    static constexpr uint32_t expectedVersion = 1;
+
+    uint32_t magic = expectedMagic;
+    uint32_t version = expectedVersion;
+
+    // The delta can only be applied to the graph of this size
+    uint32_t baseTermsCount = 0;
+    uint32_t baseClassesCount = 0;
+
+    uint32_t symbolsCount = 0;
+    uint32_t charsCount = 0;
+    uint32_t entriesWordsCount = 0;
+
+    size_t getWordsCount() const noexcept
+    {
+        return sizeof(DeltaHeader) / sizeof(uint32_t) +
+               (size_t(this->symbolsCount) + 1) + (size_t(this->charsCount) + 3) / 4 + this->entriesWordsCount;
+    }
+};
+
+static_assert(sizeof(DeltaHeader) % sizeof(uint32_t) == 0);
+
+//------------------------------------------------------------------------------
+// Writing
+
+// Where the written words go: either into one vector, see makeSnapshot,
+// or chunk by chunk into some file, see writeSnapshot
+struct VectorOutput final
+{
+    void reserve(size_t wordsCount)
+    {
+        this->words.reserve(wordsCount);
+    }
+
+    void put(uint32_t word)
+    {
+        this->words.push_back(word);
+    }
+
+    Vector<uint32_t> words;
+};
+
+struct ChunkedOutput final
+{
+    // Called for each chunk of data, returns false if it couldn't be written
+    using Write = std::function<bool(const char *data, size_t size)>;
+
+    explicit ChunkedOutput(Write write, size_t chunkWordsCount = size_t(1) << 16) :
+        write(std::move(write)), chunkWordsCount(chunkWordsCount)
+    {
+        this->chunk.reserve(chunkWordsCount);
+    }
+
+    void reserve(size_t) {} // only one chunk is kept in memory
+
+    void put(uint32_t word)
+    {
+        this->chunk.push_back(word);
+        if (this->chunk.size() == this->chunkWordsCount)
+        {
+            this->flush();
+        }
+    }
+
+    // Returns false if any of the chunks couldn't be written
+    bool flush()
+    {
+        if (!this->chunk.empty())
+        {
+            this->isOk = this->isOk &&
+                this->write(reinterpret_cast<const char *>(this->chunk.data()),
+                    this->chunk.size() * sizeof(uint32_t));
+            this->chunk.clear();
+        }
+
+        return this->isOk;
+    }
+
+private:
+
+    const Write write;
+    const size_t chunkWordsCount;
+
+    Vector<uint32_t> chunk;
+    bool isOk = true;
+};
+
+namespace detail
+{
+// The symbol table for the snapshots and the deltas: the global symbol ids
+// are only valid within one process, so the files have their own tables
+struct SymbolTable final
+{
+    uint32_t getIndex(const Symbol &symbol)
+    {
+        if (symbol.id >= this->indices.size())
+        {
+            this->indices.resize(symbol.id + 1, std::numeric_limits<uint32_t>::max());
+        }
+
+        auto &index = this->indices[symbol.id];
+        if (index == std::numeric_limits<uint32_t>::max())
+        {
+            index = uint32_t(this->symbols.size());
+            this->symbols.push_back(symbol);
+            this->charsCount += uint32_t(symbol.toString().size());
+        }
+
+        return index;
+    }
+
+    // Assumes all the symbols are already indexed
+    uint32_t getExistingIndex(const Symbol &symbol) const
+    {
+        assert(symbol.id < this->indices.size());
+        return this->indices[symbol.id];
+    }
+
+    // The offsets and then the chars, padded to whole words
+    template <typename Output>
+    void write(Output &output) const
+    {
+        uint32_t offset = 0;
+        for (const auto &symbol : this->symbols)
+        {
+            output.put(offset);
+            offset += uint32_t(symbol.toString().size());
+        }
+
+        output.put(offset);
+
+        char word[sizeof(uint32_t)] = {};
+        size_t length = 0;
+        const auto putWord = [&output, &word, &length]()
+        {
+            uint32_t result = 0;
+            std::memcpy(&result, word, sizeof(uint32_t));
+            output.put(result);
+            std::memset(word, 0, sizeof(uint32_t));
+            length = 0;
+        };
+
+        for (const auto &symbol : this->symbols)
+        {
+            for (const auto &c : symbol.toString())
+            {
+                word[length++] = c;
+                if (length == sizeof(uint32_t))
+                {
+                    putWord();
+                }
+            }
+        }
+
+        if (length > 0)
+        {
+            putWord();
+        }
+    }
+
+    static Vector<Symbol> read(const uint32_t *offsets, const char *chars, uint32_t symbolsCount)
+    {
+        Vector<Symbol> result;
+        result.reserve(symbolsCount);
+        for (uint32_t i = 0; i < symbolsCount; ++i)
+        {
+            result.emplace_back(std::string(chars + offsets[i], offsets[i + 1] - offsets[i]));
+        }
+
+        return result;
+    }
+
+    Vector<Symbol> symbols;
+    Vector<uint32_t> indices; // by symbol id
+    uint32_t charsCount = 0;
+};
+
+// The offsets start at 0, only grow, and end at the array's size
+inline bool areOffsetsValid(const uint32_t *offsets, size_t count, uint32_t total)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (offsets[i] > offsets[i + 1])
+        {
+            return false;
+        }
+    }
+
+    return offsets[0] == 0 && offsets[count] == total;
+}
+
+template <typename Header, typename Output>
+void writeHeader(const Header &header, Output &output)
+{
+    static_assert(sizeof(Header) % sizeof(uint32_t) == 0);
+    uint32_t words[sizeof(Header) / sizeof(uint32_t)];
+    std::memcpy(words, &header, sizeof(Header));
+    for (const auto &word : words)
+    {
+        output.put(word);
+    }
+}
+} // namespace detail
+
+// Writes the snapshot word by word into any of the outputs above,
+// without building anything in memory except the symbol table
+template <typename Config, typename Output>
+void writeSnapshotWords(const BasicGraph<Config> &eGraph, Output &output)
+{
+    static_assert(std::is_same_v<typename BasicGraph<Config>::TermStore, TermStore>,
+        "The snapshot's layout is the one of TermStore");
+
+    // the dirty classes are not saved
+    assert(eGraph.dirtyClasses.empty());
+
+    SnapshotHeader header;
+
+    detail::SymbolTable symbolTable;
+    for (const auto &term : eGraph.terms.terms)
+    {
+        symbolTable.getIndex(term.name);
+    }
+
+    header.symbolsCount = uint32_t(symbolTable.symbols.size());
+    header.charsCount = symbolTable.charsCount;
+    header.termsCount = uint32_t(eGraph.terms.size());
+    header.childrenCount = uint32_t(eGraph.terms.childrenIds.size());
+    header.classesCount = uint32_t(eGraph.unionFind.size());
+    header.lookupCount = uint32_t(eGraph.termsLookup.size());
+
+    for (const auto &eClass : eGraph.classes)
+    {
+        header.classTermsCount += uint32_t(eClass.terms.size());
+        header.parentsCount += uint32_t(eClass.parents.size());
+    }
+
+    output.reserve(header.getWordsCount());
+    detail::writeHeader(header, output);
+    symbolTable.write(output);
+
+    for (const auto &term : eGraph.terms.terms)
+    {
+        output.put(symbolTable.getExistingIndex(term.name));
+        output.put(term.childrenOffset);
+        output.put(term.childrenCount);
+    }
+
+    for (const auto &childId : eGraph.terms.childrenIds)
+    {
+        output.put(uint32_t(childId));
+    }
+
+    // the union-find is flattened, so that finding a root in the view takes one step
+    for (ClassId classId = 0; classId < ClassId(header.classesCount); ++classId)
+    {
+        output.put(uint32_t(eGraph.find(classId)));
+    }
+
+    uint32_t offset = 0;
+    for (const auto &eClass : eGraph.classes)
+    {
+        output.put(offset);
+        offset += uint32_t(eClass.terms.size());
+    }
+
+    output.put(offset);
+
+    for (const auto &eClass : eGraph.classes)
+    {
+        for (const auto &termId : eClass.terms)
+        {
+            output.put(uint32_t(termId));
+        }
+    }
+
+    offset = 0;
+    for (const auto &eClass : eGraph.classes)
+    {
+        output.put(offset);
+        offset += uint32_t(eClass.parents.size());
+    }
+
+    output.put(offset);
+
+    for (const auto &eClass : eGraph.classes)
+    {
+        for (const auto &parent : eClass.parents)
+        {
+            output.put(uint32_t(parent.termId));
+            output.put(uint32_t(parent.leafId));
+        }
+    }
+
+    eGraph.termsLookup.forEach([&output](TermId termId, ClassId classId)
+    {
+        output.put(uint32_t(termId));
+        output.put(uint32_t(classId));
+    });
+}
+
+// The whole snapshot in one buffer, e.g. to write it with a single call
+template <typename Config>
+Vector<uint32_t> makeSnapshot(const BasicGraph<Config> &eGraph)
+{
+    VectorOutput output;
+    writeSnapshotWords(eGraph, output);
+    return std::move(output.words);
+}
+
+// With a single write call
+template <typename Config>
+void writeSnapshot(const BasicGraph<Config> &eGraph, std::ostream &stream)
+{
+    const auto snapshot = makeSnapshot(eGraph);
+    stream.write(reinterpret_cast<const char *>(snapshot.data()),
+        std::streamsize(snapshot.size() * sizeof(uint32_t)));
+}
+
+// Writes the changes logged since the journal's checkpoint,
+// so that they can be applied to the snapshot made at that checkpoint
+template <typename Output>
+void writeDeltaWords(const Journal &journal, Output &output)
+{
+    using Type = Journal::Type;
+
+    DeltaHeader header;
+    header.baseTermsCount = uint32_t(journal.baseTermsCount);
+    header.baseClassesCount = uint32_t(journal.baseClassesCount);
+
+    detail::SymbolTable symbolTable;
+    for (const auto &entry : journal.entries)
+    {
+        if (entry.type == Type::Add)
+        {
+            symbolTable.getIndex(entry.name);
+            header.entriesWordsCount += 4 + entry.childrenCount;
+        }
+        else
+        {
+            header.entriesWordsCount += (entry.type == Type::Unite) ? 3 : 1;
+        }
+    }
+
+    header.symbolsCount = uint32_t(symbolTable.symbols.size());
+    header.charsCount = symbolTable.charsCount;
+
+    output.reserve(header.getWordsCount());
+    detail::writeHeader(header, output);
+    symbolTable.write(output);
+
+    for (const auto &entry : journal.entries)
+    {
+        output.put(uint32_t(entry.type));
+        if (entry.type == Type::Add)
+        {
+            output.put(symbolTable.getExistingIndex(entry.name));
+            output.put(uint32_t(entry.id1));
+            output.put(entry.childrenCount);
+            for (uint32_t i = 0; i < entry.childrenCount; ++i)
+            {
+                output.put(uint32_t(journal.childrenIds[entry.childrenOffset + i]));
+            }
+        }
+        else if (entry.type == Type::Unite)
+        {
+            output.put(uint32_t(entry.id1));
+            output.put(uint32_t(entry.id2));
+        }
+    }
+}
+
+inline Vector<uint32_t> makeDelta(const Journal &journal)
+{
+    VectorOutput output;
+    writeDeltaWords(journal, output);
+    return std::move(output.words);
+}
+
+inline ChunkedOutput makeStreamOutput(std::ostream &stream, size_t chunkWordsCount = size_t(1) << 16)
+{
+    return ChunkedOutput([&stream](const char *data, size_t size)
+        { return bool(stream.write(data, std::streamsize(size))); },
+        chunkWordsCount);
+}
+
+#if EGRAPH_HAS_POSIX
+
+// The partial writes are continued, and so are the ones interrupted by a signal
+inline ChunkedOutput makeFileOutput(int file, size_t chunkWordsCount = size_t(1) << 16)
+{
+    return ChunkedOutput([file](const char *data, size_t size)
+        {
+            while (size > 0)
+            {
+                const auto written = ::write(file, data, size);
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    return false;
+                }
+
+                data += written;
+                size -= size_t(written);
+            }
+
+            return true;
+        },
+        chunkWordsCount);
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Reading
+
+// A read-only view of the snapshot's memory, which doesn't copy anything,
+// so it can be queried right away, e.g. see find, and it can also be
+// loaded into a graph, which takes one pass over the arrays
+struct SnapshotView final
+{
+    // Returns nothing if the data isn't a well-formed snapshot, i.e. all
+    // the indices and offsets are checked to be in range, which takes
+    // one pass over the arrays; the data must be 4-byte aligned and outlive the view
+    static Optional<SnapshotView> open(const void *data, size_t size)
+    {
+        if (size < sizeof(SnapshotHeader) || reinterpret_cast<uintptr_t>(data) % alignof(uint32_t) != 0)
+        {
+            return {};
+        }
+
+        SnapshotView view;
+        std::memcpy(&view.header, data, sizeof(SnapshotHeader));
+        if (view.header.magic != SnapshotHeader::expectedMagic ||
+            view.header.version != SnapshotHeader::expectedVersion ||
+            view.header.getWordsCount() * sizeof(uint32_t) != size)
+        {
+            return {};
+        }
+
+        const auto &header = view.header;
+        auto *input = static_cast<const uint32_t *>(data) + sizeof(SnapshotHeader) / sizeof(uint32_t);
+        const auto take = [&input](size_t count)
+        {
+            const auto *result = input;
+            input += count;
+            return result;
+        };
+
+        view.symbolOffsets = take(size_t(header.symbolsCount) + 1);
+        view.chars = reinterpret_cast<const char *>(take((size_t(header.charsCount) + 3) / 4));
+        view.terms = take(size_t(header.termsCount) * 3);
+        view.children = reinterpret_cast<const ClassId *>(take(header.childrenCount));
+        view.unionFind = reinterpret_cast<const ClassId *>(take(header.classesCount));
+        view.classTermsOffsets = take(size_t(header.classesCount) + 1);
+        view.classTerms = reinterpret_cast<const TermId *>(take(header.classTermsCount));
+        view.classParentsOffsets = take(size_t(header.classesCount) + 1);
+        view.classParents = reinterpret_cast<const int32_t *>(take(size_t(header.parentsCount) * 2));
+        view.lookup = reinterpret_cast<const int32_t *>(take(size_t(header.lookupCount) * 2));
+        assert(input == static_cast<const uint32_t *>(data) + header.getWordsCount());
+
+        if (!view.isValid())
+        {
+            return {};
+        }
+
+        return view;
+    }
+
+    size_t getClassesCount() const noexcept
+    {
+        return this->header.classesCount;
+    }
+
+    size_t getTermsCount() const noexcept
+    {
+        return this->header.termsCount;
+    }
+
+    ClassId find(ClassId classId) const noexcept
+    {
+        while (classId != this->unionFind[classId])
+        {
+            classId = this->unionFind[classId];
+        }
+
+        return classId;
+    }
+
+    std::string_view getName(TermId termId) const noexcept
+    {
+        const auto symbolIndex = this->terms[size_t(termId) * 3];
+        const auto begin = this->symbolOffsets[symbolIndex];
+        return {this->chars + begin, this->symbolOffsets[symbolIndex + 1] - begin};
+    }
+
+    Span<const ClassId> getChildren(TermId termId) const noexcept
+    {
+        return {this->children + this->terms[size_t(termId) * 3 + 1], this->terms[size_t(termId) * 3 + 2]};
+    }
+
+    // Empty for the non-root classes
+    Span<const TermId> getClassTerms(ClassId classId) const noexcept
+    {
+        const auto begin = this->classTermsOffsets[classId];
+        return {this->classTerms + begin, this->classTermsOffsets[classId + 1] - begin};
+    }
+
+    // The pointer-free fixup: interns each symbol once, copies the arrays
+    // into the graph's vectors and re-inserts the lookup entries
+    template <typename GraphType = Graph>
+    GraphType load() const
+    {
+        static_assert(!GraphType::hasAnalysis, "The analysis data is not serialized");
+        static_assert(!GraphType::hasExplanations, "The proofs are not serialized");
+        static_assert(std::is_same_v<typename GraphType::TermStore, TermStore>,
+            "The snapshot's layout is the one of TermStore");
+
+        GraphType eGraph;
+
+        const auto symbols = detail::SymbolTable::read(this->symbolOffsets, this->chars, this->header.symbolsCount);
+
+        eGraph.terms.terms.resize(this->header.termsCount);
+        for (uint32_t i = 0; i < this->header.termsCount; ++i)
+        {
+            auto &term = eGraph.terms.terms[i];
+            term.name = symbols[this->terms[size_t(i) * 3]];
+            term.childrenOffset = this->terms[size_t(i) * 3 + 1];
+            term.childrenCount = this->terms[size_t(i) * 3 + 2];
+        }
+
+        eGraph.terms.childrenIds.assign(this->children, this->children + this->header.childrenCount);
+
+        eGraph.unionFind.setParents({this->unionFind, this->unionFind + this->header.classesCount});
+
+        eGraph.classes.reserve(this->header.classesCount);
+        for (ClassId classId = 0; classId < ClassId(this->header.classesCount); ++classId)
+        {
+            auto &eClass = eGraph.classes.emplace_back(classId);
+            if (this->unionFind[classId] != classId)
+            {
+                eClass.makeTombstone();
+                continue;
+            }
+
+            const auto terms = this->getClassTerms(classId);
+            eClass.terms.assign(terms.begin(), terms.end());
+
+            const auto parentsBegin = this->classParentsOffsets[classId];
+            const auto parentsEnd = this->classParentsOffsets[classId + 1];
+            eClass.parents.reserve(parentsEnd - parentsBegin);
+            for (auto i = parentsBegin; i < parentsEnd; ++i)
+            {
+                eClass.addParent(this->classParents[size_t(i) * 2], this->classParents[size_t(i) * 2 + 1]);
+            }
+        }
+
+        for (uint32_t i = 0; i < this->header.lookupCount; ++i)
+        {
+            eGraph.termsLookup.insert(eGraph.terms, this->lookup[size_t(i) * 2], this->lookup[size_t(i) * 2 + 1]);
+        }
+
+        eGraph.restoreOperatorIndex();
+
+        return eGraph;
+    }
+
+private:
+
+    SnapshotView() = default;
+
+    // Checks everything that find, getName, getChildren and load
+    // would otherwise read out of bounds or loop over forever
+    bool isValid() const noexcept
+    {
+        const auto &header = this->header;
+
+        // every stride's id is less than the limit, which also rejects the negative ones
+        const auto areIdsValid = [](const auto *ids, size_t count, size_t stride, uint32_t limit)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (uint32_t(ids[i * stride]) >= limit)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        if (!detail::areOffsetsValid(this->symbolOffsets, header.symbolsCount, header.charsCount) ||
+            !areIdsValid(this->terms, header.termsCount, 3, header.symbolsCount) ||
+            !areIdsValid(this->children, header.childrenCount, 1, header.classesCount) ||
+            !areIdsValid(this->unionFind, header.classesCount, 1, header.classesCount) ||
+            !detail::areOffsetsValid(this->classTermsOffsets, header.classesCount, header.classTermsCount) ||
+            !areIdsValid(this->classTerms, header.classTermsCount, 1, header.termsCount) ||
+            !detail::areOffsetsValid(this->classParentsOffsets, header.classesCount, header.parentsCount) ||
+            !areIdsValid(this->classParents, header.parentsCount, 2, header.termsCount) ||
+            !areIdsValid(this->classParents + 1, header.parentsCount, 2, header.classesCount) ||
+            !areIdsValid(this->lookup, header.lookupCount, 2, header.termsCount) ||
+            !areIdsValid(this->lookup + 1, header.lookupCount, 2, header.classesCount))
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < header.termsCount; ++i)
+        {
+            const auto childrenEnd = size_t(this->terms[i * 3 + 1]) + this->terms[i * 3 + 2];
+            if (childrenEnd > header.childrenCount)
+            {
+                return false;
+            }
+        }
+
+        // the union-find is written flattened, so each parent is a root,
+        // and find can't loop
+        for (size_t i = 0; i < header.classesCount; ++i)
+        {
+            if (this->unionFind[this->unionFind[i]] != this->unionFind[i])
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    SnapshotHeader header;
+
+    const uint32_t *symbolOffsets = nullptr;
+    const char *chars = nullptr;
+    const uint32_t *terms = nullptr;
+    const ClassId *children = nullptr;
+    const ClassId *unionFind = nullptr;
+    const uint32_t *classTermsOffsets = nullptr;
+    const TermId *classTerms = nullptr;
+    const uint32_t *classParentsOffsets = nullptr;
+    const int32_t *classParents = nullptr;
+    const int32_t *lookup = nullptr;
+};
+
+// Replays the delta onto the graph as it was when the delta's journal
+// was checkpointed, e.g. loaded from the snapshot made at that point;
+// returns false if the delta doesn't fit the graph, in which case
+// the graph might be already partially changed
+template <typename GraphType>
+bool applyDelta(GraphType &eGraph, const void *data, size_t size)
+{
+    static_assert(!GraphType::hasAnalysis, "The analysis would redo its changes");
+
+    using Type = Journal::Type;
+
+    DeltaHeader header;
+    if (size < sizeof(DeltaHeader) || reinterpret_cast<uintptr_t>(data) % alignof(uint32_t) != 0)
+    {
+        return false;
+    }
+
+    std::memcpy(&header, data, sizeof(DeltaHeader));
+    if (header.magic != DeltaHeader::expectedMagic ||
+        header.version != DeltaHeader::expectedVersion ||
+        header.getWordsCount() * sizeof(uint32_t) != size ||
+        header.baseTermsCount != eGraph.getTermsCount() ||
+        header.baseClassesCount != eGraph.classes.size())
+    {
+        return false;
+    }
+
+    const auto *input = static_cast<const uint32_t *>(data) + sizeof(DeltaHeader) / sizeof(uint32_t);
+    const auto *symbolOffsets = input;
+    input += header.symbolsCount + 1;
+    const auto *chars = reinterpret_cast<const char *>(input);
+    input += (size_t(header.charsCount) + 3) / 4;
+
+    if (!detail::areOffsetsValid(symbolOffsets, header.symbolsCount, header.charsCount))
+    {
+        return false;
+    }
+
+    const auto symbols = detail::SymbolTable::read(symbolOffsets, chars, header.symbolsCount);
+
+    // the ids can only refer to the classes that already exist at that point
+    const auto areClassIdsValid = [&eGraph](const uint32_t *ids, size_t count)
+    {
+        return std::all_of(ids, ids + count,
+            [&eGraph](uint32_t id) { return id < eGraph.classes.size(); });
+    };
+
+    const auto *end = input + header.entriesWordsCount;
+    while (input < end)
+    {
+        // compared as the whole word, so that e.g. 0x101 isn't taken for Unite
+        const auto type = *input++;
+        if (type == uint32_t(Type::Add))
+        {
+            if (end - input < 3 || size_t(end - input) < 3 + size_t(input[2]) ||
+                input[0] >= symbols.size() || !areClassIdsValid(input + 3, input[2]))
+            {
+                return false;
+            }
+
+            const auto &name = symbols[input[0]];
+            const auto classId = ClassId(input[1]);
+            const Span<const ClassId> childrenIds(reinterpret_cast<const ClassId *>(input + 3), input[2]);
+            input += 3 + childrenIds.size();
+
+            // the graph is in the same state as the logged one was,
+            // so the term is new here too and gets the same id
+            if (eGraph.add(name, childrenIds) != classId)
+            {
+                return false;
+            }
+        }
+        else if (type == uint32_t(Type::Unite))
+        {
+            if (end - input < 2 || !areClassIdsValid(input, 2))
+            {
+                return false;
+            }
+
+            eGraph.unite(ClassId(input[0]), ClassId(input[1]));
+            input += 2;
+        }
+        else if (type == uint32_t(Type::Rebuild))
+        {
+            eGraph.restoreInvariants();
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return input == end;
+}
+
+#if EGRAPH_HAS_POSIX
+
+// The snapshot file mapped into memory, read-only
+struct MappedSnapshot final
+{
+    explicit MappedSnapshot(const char *path)
+    {
+        const auto file = ::open(path, O_RDONLY);
+        if (file < 0)
+        {
+            return;
+        }
+
+        struct stat status;
+        if (::fstat(file, &status) == 0 && status.st_size > 0)
+        {
+            auto *data = ::mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+            if (data != MAP_FAILED)
+            {
+                this->data = data;
+                this->size = size_t(status.st_size);
+            }
+        }
+
+        ::close(file);
+    }
+
+    ~MappedSnapshot()
+    {
+        if (this->data != nullptr)
+        {
+            ::munmap(this->data, this->size);
+        }
+    }
+
+    MappedSnapshot(const MappedSnapshot &) = delete;
+    MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+
+    // Returns nothing if the file couldn't be mapped or isn't a snapshot
+    Optional<SnapshotView> getView() const
+    {
+        return this->data != nullptr ? SnapshotView::open(this->data, this->size) : Optional<SnapshotView>();
+    }
+
+private:
+
+    void *data = nullptr;
+    size_t size = 0;
+};
+
+#endif
+} // namespace e
@@ -0,0 +1,292 @@
+/*
+ * A simple e-graph implementation for educational purposes
+ *
+ * Copyright waived by Peter Rudenko <peter.rudenko@gmail.com>, 2023
+ *
+ * The contents of this file is free and unencumbered software released into the
+ * public domain. For more information, please refer to <http://unlicense.org/>
+ */
+
+#pragma once
+
+#include "EGraph.h"
+
+#include <chrono>
+#include <string>
+
+namespace e
+{
+
+namespace detail
+{
+    inline std::string toJsonString(const std::string &text)
+    {
+        std::string result = "\"";
+        for (const auto &c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                result += '\\';
+                result += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                static const char *const digits = "0123456789abcdef";
+                result += "\\u00";
+                result += digits[(c >> 4) & 0xf];
+                result += digits[c & 0xf];
+            }
+            else
+            {
+                result += c;
+            }
+        }
+
+        return result + "\"";
+    }
+} // namespace detail
+
+//------------------------------------------------------------------------------
+// Statistics
+
+// Counts what the graph does, to see where the saturation spends its time:
+// to collect them, set Stats = GraphStats in the graph's config, see NoStats,
+// and then the runner also times the phases of each iteration, see Runner::run
+struct GraphStats final
+{
+    using Clock = std::chrono::steady_clock;
+
+    // The rules are told apart by their names, so the unnamed ones are summed up
+    struct RuleStats final
+    {
+        Symbol name;
+        size_t searches = 0;
+        size_t attempts = 0; // the candidate classes for the pattern's root
+        size_t matches = 0;
+    };
+
+    struct Iteration final
+    {
+        size_t index;
+        Clock::time_point searchStartTime;
+        Clock::time_point applyStartTime;
+        Clock::time_point rebuildStartTime;
+        Clock::time_point endTime;
+        size_t matchesCount;
+        size_t unitedCount;
+        size_t classesCount;
+        size_t termsCount;
+    };
+
+    // The hooks called by the graph and the runner
+
+    void onSearch(const Symbol &ruleName, size_t attempts, size_t matchesCount)
+    {
+        const auto [found, isNew] = this->ruleIndices.try_emplace(ruleName, this->rules.size());
+        if (isNew)
+        {
+            this->rules.push_back({ruleName});
+        }
+
+        auto &ruleStats = this->rules[found->second];
+        ruleStats.searches++;
+        ruleStats.attempts += attempts;
+        ruleStats.matches += matchesCount;
+    }
+
+    void onAdd(bool isHit)
+    {
+        (isHit ? this->addHits : this->addMisses)++;
+    }
+
+    void onUnite(bool isEffective)
+    {
+        this->uniteCalls++;
+        this->unionsCount += isEffective ? 1 : 0;
+    }
+
+    void onRebuild()
+    {
+        this->rebuildsCount++;
+    }
+
+    // Called for each pass of the rebuild with its deduplicated worklist
+    void onRepair(size_t worklistSize)
+    {
+        this->repairPassesCount++;
+        this->repairedClassesCount += worklistSize;
+        this->maxWorklistSize = std::max(this->maxWorklistSize, worklistSize);
+    }
+
+    void onIteration(const Iteration &iteration)
+    {
+        this->iterations.push_back(iteration);
+    }
+
+    void reset()
+    {
+        *this = {};
+    }
+
+    std::string toJson() const
+    {
+        std::string result = "{\"rules\":[";
+        for (size_t i = 0; i < this->rules.size(); ++i)
+        {
+            const auto &ruleStats = this->rules[i];
+            result += (i > 0 ? ",{\"name\":" : "{\"name\":") + detail::toJsonString(ruleStats.name.toString()) +
+                ",\"searches\":" + std::to_string(ruleStats.searches) +
+                ",\"attempts\":" + std::to_string(ruleStats.attempts) +
+                ",\"matches\":" + std::to_string(ruleStats.matches) + "}";
+        }
+
+        result += "],\"adds\":{\"hits\":" + std::to_string(this->addHits) +
+            ",\"misses\":" + std::to_string(this->addMisses) +
+            "},\"unites\":{\"calls\":" + std::to_string(this->uniteCalls) +
+            ",\"unions\":" + std::to_string(this->unionsCount) +
+            "},\"rebuilds\":{\"count\":" + std::to_string(this->rebuildsCount) +
+            ",\"passes\":" + std::to_string(this->repairPassesCount) +
+            ",\"repairedClasses\":" + std::to_string(this->repairedClassesCount) +
+            ",\"maxWorklistSize\":" + std::to_string(this->maxWorklistSize) + "},\"iterations\":[";
+
+        for (size_t i = 0; i < this->iterations.size(); ++i)
+        {
+            const auto &iteration = this->iterations[i];
+            result += (i > 0 ? ",{\"index\":" : "{\"index\":") + std::to_string(iteration.index) +
+                ",\"searchMicroseconds\":" + GraphStats::toString(iteration.applyStartTime - iteration.searchStartTime) +
+                ",\"applyMicroseconds\":" + GraphStats::toString(iteration.rebuildStartTime - iteration.applyStartTime) +
+                ",\"rebuildMicroseconds\":" + GraphStats::toString(iteration.endTime - iteration.rebuildStartTime) +
+                ",\"matches\":" + std::to_string(iteration.matchesCount) +
+                ",\"unions\":" + std::to_string(iteration.unitedCount) +
+                ",\"classes\":" + std::to_string(iteration.classesCount) +
+                ",\"terms\":" + std::to_string(iteration.termsCount) + "}";
+        }
+
+        return result + "]}";
+    }
+
+    // The iterations' phases in the Trace Event Format, which can be opened
+    // in chrome://tracing or Perfetto, along with the counters of the graph size
+    std::string toChromeTrace() const
+    {
+        std::string result = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        const auto addPhase = [&](const char *name, size_t index, Clock::time_point begin, Clock::time_point end)
+        {
+            result += std::string(result.back() == '[' ? "" : ",") +
+                "{\"name\":\"" + name + "\",\"cat\":\"saturation\",\"ph\":\"X\",\"pid\":0,\"tid\":0" +
+                ",\"ts\":" + this->toString(begin - this->startTime) +
+                ",\"dur\":" + this->toString(end - begin) +
+                ",\"args\":{\"iteration\":" + std::to_string(index) + "}}";
+        };
+
+        for (const auto &iteration : this->iterations)
+        {
+            addPhase("search", iteration.index, iteration.searchStartTime, iteration.applyStartTime);
+            addPhase("apply", iteration.index, iteration.applyStartTime, iteration.rebuildStartTime);
+            addPhase("rebuild", iteration.index, iteration.rebuildStartTime, iteration.endTime);
+
+            result += ",{\"name\":\"graph\",\"ph\":\"C\",\"pid\":0,\"ts\":" +
+                this->toString(iteration.endTime - this->startTime) +
+                ",\"args\":{\"classes\":" + std::to_string(iteration.classesCount) +
+                ",\"terms\":" + std::to_string(iteration.termsCount) + "}}";
+        }
+
+        return result + "]}";
+    }
+
+    Vector<RuleStats> rules;
+    HashMap<Symbol, size_t, Symbol::Hash> ruleIndices;
+
+    size_t addHits = 0; // the term was already in the lookup
+    size_t addMisses = 0;
+
+    size_t uniteCalls = 0;
+    size_t unionsCount = 0; // the calls that actually merged something
+
+    size_t rebuildsCount = 0;
+    size_t repairPassesCount = 0;
+    size_t repairedClassesCount = 0;
+    size_t maxWorklistSize = 0;
+
+    Vector<Iteration> iterations;
+
+    // The origin of the trace's timestamps
+    Clock::time_point startTime = Clock::now();
+
+private:
+
+    // In microseconds, which is what the trace format expects
+    static std::string toString(Clock::duration duration)
+    {
+        return std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    }
+};
+
+//------------------------------------------------------------------------------
+// Memory footprint
+
+// The graph's size, computed on demand, see getFootprint below;
+// the memory is in bytes, counting the capacities rather than the sizes,
+// but not the analysis data and the explanations
+struct GraphFootprint final
+{
+    size_t classesCount = 0; // alive ones only
+    size_t deadClassesCount = 0;
+    size_t termsCount = 0;
+    size_t lookupEntriesCount = 0;
+
+    size_t termsMemory = 0;
+    size_t classesMemory = 0;
+    size_t lookupMemory = 0;
+    size_t unionFindMemory = 0;
+    size_t operatorIndexMemory = 0;
+
+    size_t getTotalMemory() const noexcept
+    {
+        return this->termsMemory + this->classesMemory + this->lookupMemory +
+            this->unionFindMemory + this->operatorIndexMemory;
+    }
+
+    std::string toJson() const
+    {
+        return "{\"classes\":" + std::to_string(this->classesCount) +
+            ",\"deadClasses\":" + std::to_string(this->deadClassesCount) +
+            ",\"terms\":" + std::to_string(this->termsCount) +
+            ",\"lookupEntries\":" + std::to_string(this->lookupEntriesCount) +
+            ",\"memory\":{\"terms\":" + std::to_string(this->termsMemory) +
+            ",\"classes\":" + std::to_string(this->classesMemory) +
+            ",\"lookup\":" + std::to_string(this->lookupMemory) +
+            ",\"unionFind\":" + std::to_string(this->unionFindMemory) +
+            ",\"operatorIndex\":" + std::to_string(this->operatorIndexMemory) +
+            ",\"total\":" + std::to_string(this->getTotalMemory()) + "}}";
+    }
+};
+
+template <typename GraphType>
+GraphFootprint getFootprint(const GraphType &graph)
+{
+    GraphFootprint result;
+    result.termsCount = graph.getTermsCount();
+    result.lookupEntriesCount = graph.termsLookup.size();
+
+    for (const auto &eClass : graph.classes)
+    {
+        (eClass.isAlive() ? result.classesCount : result.deadClassesCount)++;
+        result.classesMemory += eClass.getMemoryUsage();
+    }
+
+    result.classesMemory += (graph.classes.capacity() - graph.classes.size()) * sizeof(typename GraphType::Class);
+
+    result.termsMemory = graph.terms.getMemoryUsage();
+    result.lookupMemory = graph.termsLookup.getMemoryUsage();
+    result.unionFindMemory = graph.unionFind.getMemoryUsage();
+
+    for (const auto &[op, classIds] : graph.classesByOperator)
+    {
+        result.operatorIndexMemory += sizeof(op) + classIds.capacity() * sizeof(ClassId);
+    }
+
+    return result;
+}
+} // namespace e
@@ -83,17 +83,17 @@ Pattern makePattern(const Ast::Node &astNode)
     assert(false);
 }
 
-RewriteRule makeRewriteRule(const Ast::Node &astNode)
+template <typename GraphType = Graph>
+BasicRewriteRule<GraphType> makeRewriteRule(const Ast::Node &astNode)
 {
     assert(astNode.is_root());
     assert(astNode.children.size() == 2);
-    RewriteRule rule;
-    rule.leftHand = makePattern(*astNode.children.front());
-    rule.rightHand = makePattern(*astNode.children.back());
-    return rule;
+    return BasicRewriteRule<GraphType>(makePattern(*astNode.children.front()),
+        makePattern(*astNode.children.back()));
 }
 
-ClassId makeExpression(const Ast::Node &astNode, Graph &eGraph)
+template <typename GraphType>
+ClassId makeExpression(const Ast::Node &astNode, GraphType &eGraph)
 {
     if (astNode.is_root())
     {
@@ -128,7 +128,8 @@ ClassId makeExpression(const Ast::Node &astNode, Graph &eGraph)
     assert(false);
 }
 
-ClassId makeExpression(const std::string &expression, Graph &eGraph)
+template <typename GraphType>
+ClassId makeExpression(const std::string &expression, GraphType &eGraph)
 {
     using namespace tao::pegtl;
     string_input input(expression, "");
@@ -136,11 +137,28 @@ ClassId makeExpression(const std::string &expression, Graph &eGraph)
     return makeExpression(*node, eGraph);
 }
 
-RewriteRule makeRewriteRule(const std::string &expression)
+template <typename GraphType = Graph>
+BasicRewriteRule<GraphType> makeRewriteRule(const std::string &expression)
 {
     using namespace tao::pegtl;
     string_input input(expression, "");
     const auto node = parse_tree::parse<Ast::Grammar, Ast::Node, Ast::Selector>(input);
-    return makeRewriteRule(*node);
+    auto rule = makeRewriteRule<GraphType>(*node);
+    rule.name = expression;
+    return rule;
+}
+
+// Parses the rules once, e.g. to share them between many graphs, see RuleSet
+template <typename GraphType = Graph>
+BasicRuleSet<GraphType> makeRuleSet(const Vector<std::string> &expressions)
+{
+    Vector<BasicRewriteRule<GraphType>> rules;
+    rules.reserve(expressions.size());
+    for (const auto &expression : expressions)
+    {
+        rules.push_back(makeRewriteRule<GraphType>(expression));
+    }
+
+    return BasicRuleSet<GraphType>(std::move(rules));
 }
 } // namespace TestLanguage
@@ -2,6 +2,13 @@
 #include "EGraph.h"
 #include "TestLanguage.h"
 #include "Serialization.h"
+#include "Runner.h"
+#include "Extraction.h"
+#include "Snapshot.h"
+#include "Stats.h"
+
+#include <fstream>
+#include <sstream>
 
 using namespace TestLanguage;
 
@@ -106,6 +113,591 @@ void rewriteDistributivityRuleTest()
     assert(eGraph.find(expr2) == eGraph.find(expr3));
 }
 
+void batchRewriteTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto expr1 = makeExpression("(a * 1) + b", eGraph);
+    const auto expr2 = makeExpression("b + a", eGraph);
+
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x * 1 => $x"),
+        makeRewriteRule("$x + $y => $y + $x")};
+
+    // when
+    eGraph.rewrite(rules);
+
+    // then
+    assert(eGraph.find(expr1) == eGraph.find(expr2));
+}
+
+void saturationTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto zeroTerm = eGraph.addTerm("0");
+    const auto zero = makeExpression("((a - b) * 0) * ((b + c) * 0)", eGraph);
+
+    // when
+    e::Runner runner(eGraph);
+    const auto report = runner.run({makeRewriteRule("$x * 0 => 0")});
+
+    // then
+    assert(report.stopReason == e::StopReason::Saturated);
+    assert(report.iterations == 3); // the last one doesn't change anything
+    assert(eGraph.find(zero) == eGraph.find(zeroTerm));
+}
+
+void saturationLimitsTest()
+{
+    // given
+    e::Graph eGraph;
+
+    makeExpression("(((a + b) + c) + d) + e", eGraph);
+
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x + $y => $y + $x"),
+        makeRewriteRule("($x + $y) + $z => $x + ($y + $z)")};
+
+    e::SaturationLimits limits;
+    limits.iterations = 2;
+
+    // when
+    const auto report1 = e::Runner(eGraph, limits).run(rules);
+
+    // then
+    assert(report1.stopReason == e::StopReason::IterationLimit);
+    assert(report1.iterations == 2);
+
+    // and when
+    limits.iterations = 100;
+    limits.classes = eGraph.getClassesCount();
+    const auto report2 = e::Runner(eGraph, limits).run(rules);
+
+    // then
+    assert(report2.stopReason == e::StopReason::ClassLimit);
+    assert(report2.iterations == 1);
+}
+
+void backoffSchedulerTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto abcd1 = makeExpression("((a + b) + c) + d", eGraph);
+    const auto abcd2 = makeExpression("d + (c + (b + a))", eGraph);
+
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x + $y => $y + $x"),
+        makeRewriteRule("($x + $y) + $z => $x + ($y + $z)")};
+
+    e::BackoffScheduler scheduler(8, 1);
+
+    // when
+    const auto report = e::Runner(eGraph).run(rules, scheduler);
+
+    // then
+    assert(report.stopReason == e::StopReason::Saturated);
+    assert(scheduler.getStats()[0].timesBanned > 0);
+    assert(eGraph.find(abcd1) == eGraph.find(abcd2));
+
+    // and when
+    e::BackoffScheduler explodingScheduler(0, 1);
+    e::Matches matches;
+    matches.add({abcd1}, {}, 0);
+
+    for (size_t iteration = 0; iteration < 100; ++iteration)
+    {
+        explodingScheduler.canSearch(iteration, 0);
+        assert(!explodingScheduler.canApply(iteration, 0, matches));
+    }
+
+    // then the ban length stops doubling at the maximum instead of overflowing
+    assert(explodingScheduler.getStats()[0].timesBanned == 100);
+    assert(explodingScheduler.getStats()[0].bannedUntil == std::numeric_limits<size_t>::max());
+}
+
+void relationalMatchingTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto zeroTerm = eGraph.addTerm("0");
+    const auto expr1 = makeExpression("(a + b) - (b + a)", eGraph);
+    const auto expr2 = makeExpression("((a - a) + c) * 0", eGraph);
+
+    const auto subtraction = makeRewriteRule("$x - $x => 0");
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x + $y => $y + $x"),
+        e::RewriteRule(subtraction.leftHand, subtraction.rightHand, e::MatchingEngine::Relational)};
+
+    // when
+    e::Runner(eGraph).run(rules);
+
+    // then
+    assert(eGraph.find(expr1) == eGraph.find(zeroTerm));
+    assert(eGraph.find(expr2) != eGraph.find(zeroTerm));
+
+    // and when
+    eGraph.matchingEngine = e::MatchingEngine::Relational;
+    e::Runner(eGraph).run({makeRewriteRule("$x * 0 => 0")});
+
+    // then
+    assert(eGraph.find(expr2) == eGraph.find(zeroTerm));
+}
+
+void parallelSearchTest()
+{
+    // given
+    e::Graph eGraph1;
+    e::Graph eGraph2;
+
+    auto sum1 = eGraph1.addTerm("x0");
+    auto sum2 = eGraph2.addTerm("x0");
+    for (int i = 1; i < 300; ++i)
+    {
+        const auto name = "x" + std::to_string(i);
+        sum1 = eGraph1.addOperation("+", {sum1, eGraph1.addTerm(name)});
+        sum2 = eGraph2.addOperation("+", {sum2, eGraph2.addTerm(name)});
+    }
+
+    e::ThreadPool threadPool(4);
+    eGraph2.threadPool = &threadPool;
+
+    const auto commutativity = makeRewriteRule("$x + $y => $y + $x");
+
+    // when
+    const auto matches1 = eGraph1.search(commutativity);
+    const auto matches2 = eGraph2.search(commutativity);
+
+    // then
+    assert(matches1.size() == 299);
+    assert(matches1.substitutions == matches2.substitutions);
+
+    // and when
+    e::SaturationLimits limits;
+    limits.iterations = 2;
+    const e::Vector<e::RewriteRule> rules{commutativity,
+        makeRewriteRule("($x + $y) + $z => $x + ($y + $z)")};
+
+    e::Runner(eGraph1, limits).run(rules);
+    e::Runner(eGraph2, limits).run(rules);
+
+    // then
+    assert(eGraph1.getClassesCount() == eGraph2.getClassesCount());
+    assert(eGraph1.getTermsCount() == eGraph2.getTermsCount());
+}
+
+template <typename UnionFind>
+void canonicalizationTest()
+{
+    // given
+    UnionFind unionFind;
+    for (int i = 0; i < 1000; ++i)
+    {
+        unionFind.addSet();
+    }
+
+    // a few deep chains, and the rest are left alone
+    for (e::ClassId i = 4; i < 600; ++i)
+    {
+        unionFind.unite(unionFind.find(i % 4), unionFind.find(i));
+    }
+
+    e::Vector<e::ClassId> ids;
+    for (e::ClassId i = 0; i < 1003; ++i)
+    {
+        ids.push_back((i * 7919) % 1000);
+    }
+
+    const auto expectedIds = ids;
+
+    // when
+    unionFind.canonicalize(ids);
+
+    // then
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        assert(ids[i] == unionFind.find(expectedIds[i]));
+        assert(unionFind.find(ids[i]) == ids[i]);
+    }
+}
+
+void concurrentRebuildTest()
+{
+    // given
+    e::Graph eGraph1;
+    e::BasicGraph<e::ConcurrentGraphConfig> eGraph2;
+
+    e::Vector<std::string> expressions;
+    for (int i = 0; i < 50; ++i)
+    {
+        const auto x = "x" + std::to_string(i);
+        const auto y = "y" + std::to_string(i % 7);
+        expressions.push_back("((" + x + " + " + y + ") * 1) + (" + y + " + " + x + ")");
+        expressions.push_back("(" + y + " * 0) + ((" + x + " + 0) * " + y + ")");
+    }
+
+    e::Vector<e::ClassId> ids1;
+    e::Vector<e::ClassId> ids2;
+    for (const auto &expression : expressions)
+    {
+        ids1.push_back(makeExpression(expression, eGraph1));
+        ids2.push_back(makeExpression(expression, eGraph2));
+    }
+
+    e::ThreadPool threadPool(4);
+    eGraph2.threadPool = &threadPool;
+
+    e::Vector<e::RewriteRule> rules1;
+    e::Vector<decltype(eGraph2)::RewriteRule> rules2;
+    for (const auto &rule : {"$x + $y => $y + $x", "$x * 1 => $x",
+             "$x + 0 => $x", "$x * 0 => 0", "0 + $x => $x"})
+    {
+        rules1.push_back(makeRewriteRule(rule));
+        rules2.push_back(makeRewriteRule<decltype(eGraph2)>(rule));
+    }
+
+    // when
+    e::SaturationLimits limits;
+    limits.iterations = 4;
+    e::Runner(eGraph1, limits).run(rules1);
+    e::Runner(eGraph2, limits).run(rules2);
+
+    // then
+    assert(eGraph1.getClassesCount() == eGraph2.getClassesCount());
+    for (size_t i = 0; i < ids1.size(); ++i)
+    {
+        for (size_t j = 0; j < ids1.size(); ++j)
+        {
+            assert((eGraph1.find(ids1[i]) == eGraph1.find(ids1[j])) ==
+                (eGraph2.find(ids2[i]) == eGraph2.find(ids2[j])));
+        }
+    }
+
+    const auto otherGraph = e::deserialize<decltype(eGraph2)>(e::serialize(eGraph2));
+    assert(otherGraph.find(ids2.back()) == eGraph2.find(ids2.back()));
+}
+
+void extractionTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto expr = makeExpression("((a * 1) + (b * 0)) * ((a * 1) + (b * 0))", eGraph);
+
+    // when
+    e::Runner(eGraph).run({
+        makeRewriteRule("$x * 1 => $x"),
+        makeRewriteRule("$x * 0 => 0"),
+        makeRewriteRule("$x + 0 => $x")});
+
+    // the graph is cyclic now, e.g. the class of a contains a * 1
+    const e::Extractor<size_t> extractor(eGraph, e::astSize);
+
+    // then
+    assert(extractor.getCost(expr) == size_t(3));
+    assert(extractor.extractTerm(expr)->toString() == "(* a a)");
+
+    const auto dag = extractor.extractDag(expr);
+    assert(dag->size() == 2);
+    assert(dag->getChildren(1).toVector() == e::Vector<uint32_t>({0, 0}));
+
+    // and when the products cost less than their children, against the rules,
+    // the best term of a is a * 1, which makes a cycle
+    const auto freeProducts = [](const e::Symbol &name, e::Span<const size_t>)
+    {
+        return (name == e::Symbol("*")) ? size_t(0) : size_t(1);
+    };
+
+    const e::Extractor<size_t> cyclicExtractor(eGraph, freeProducts);
+
+    // then it's not extracted, instead of looping forever
+    assert(!cyclicExtractor.extractDag(expr).has_value());
+    assert(!cyclicExtractor.extractTerm(expr).has_value());
+
+    // and when
+    const auto customCost = [](const e::Symbol &name, e::Span<const double> childrenCosts)
+    {
+        double result = (name == e::Symbol("*")) ? 10.0 : 1.0;
+        for (const auto &cost : childrenCosts)
+        {
+            result += cost;
+        }
+
+        return result;
+    };
+
+    const auto square = makeExpression("a + a", eGraph);
+    eGraph.unite(square, expr);
+    eGraph.restoreInvariants();
+
+    const e::Extractor<double> customExtractor(eGraph, customCost);
+
+    // then
+    assert(customExtractor.extractTerm(expr)->toString() == "(+ a a)");
+}
+
+void deepExtractionTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto a = eGraph.addTerm("a");
+    const auto b = eGraph.addTerm("b");
+
+    const size_t depth = 100000;
+    e::Vector<e::ClassId> chain{a};
+    for (size_t i = 0; i < depth; ++i)
+    {
+        const e::Vector<e::ClassId> childrenIds{chain.back(), b};
+        chain.push_back(eGraph.addOperation("+", childrenIds));
+    }
+
+    // when
+    eGraph.unite(chain[depth / 2], eGraph.addOperation("*", e::Vector<e::ClassId>{a, a}));
+    eGraph.restoreInvariants();
+
+    const e::Extractor<size_t> extractor(eGraph, e::astDepth);
+    const auto dag = extractor.extractDag(chain.back());
+
+    // then
+    assert(extractor.getCost(chain.back()) == depth - depth / 2 + 2);
+    assert(dag->size() == depth - depth / 2 + 3);
+    assert(dag->getName(uint32_t(dag->size() - 1)) == e::Symbol("+"));
+}
+
+void incrementalExtractionTest()
+{
+    // given
+    e::Graph eGraph;
+    eGraph.tracksChanges = true;
+
+    const auto expr1 = makeExpression("((a * (b + 0)) * 1) + ((c * 0) + (b * a))", eGraph);
+    const auto expr2 = makeExpression("(d + (c * 1)) * ((a + 0) + (b * 0))", eGraph);
+
+    e::Extractor<size_t> extractor(eGraph, e::astSize);
+    eGraph.takeChangedClassIds();
+
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x * 1 => $x"),
+        makeRewriteRule("$x * 0 => 0"),
+        makeRewriteRule("$x + 0 => $x"),
+        makeRewriteRule("0 + $x => $x"),
+        makeRewriteRule("$x * $y => $y * $x")};
+
+    e::SaturationLimits limits;
+    limits.iterations = 1;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        // when
+        e::Runner(eGraph, limits).run(rules);
+        extractor.update(eGraph.takeChangedClassIds());
+
+        // then
+        const e::Extractor<size_t> freshExtractor(eGraph, e::astSize);
+        for (const auto &eClass : eGraph.classes)
+        {
+            if (eClass.isAlive())
+            {
+                assert(extractor.getCost(eClass.id) == freshExtractor.getCost(eClass.id));
+            }
+        }
+    }
+
+    assert(extractor.getCost(expr1) == size_t(7));
+    assert(extractor.extractTerm(expr2)->toString() == "(* (+ d c) a)");
+
+    // and given
+    e::Graph untrackedGraph;
+    const auto expr3 = makeExpression("(a * 1) + (b * 0)", untrackedGraph);
+    e::Extractor<size_t> untrackedExtractor(untrackedGraph, e::astSize);
+
+    // when
+    e::Runner(untrackedGraph).run(rules);
+    untrackedExtractor.update(untrackedGraph.takeChangedClassIds());
+
+    // then
+    assert(untrackedExtractor.getCost(expr3) == size_t(1));
+}
+
+// Folds the integer constants, e.g. (2 + 3) * x => 5 * x
+struct ConstantFolding final
+{
+    using Data = e::Optional<int64_t>;
+
+    template <typename GraphType>
+    Data make(const GraphType &eGraph, const e::Symbol &name, e::Span<const e::ClassId> childrenIds)
+    {
+        const auto string = name.toString();
+        if (childrenIds.empty())
+        {
+            const auto isNumber = !string.empty() &&
+                std::all_of(string.begin(), string.end(), [](char c) { return std::isdigit(c); });
+            return isNumber ? Data(std::stoll(string)) : Data();
+        }
+
+        const auto &left = eGraph.getData(childrenIds[0]);
+        const auto &right = eGraph.getData(childrenIds[1]);
+        if (!left || !right)
+        {
+            return {};
+        }
+
+        if (string == "+")
+        {
+            return *left + *right;
+        }
+        else if (string == "-")
+        {
+            return *left - *right;
+        }
+        else if (string == "*")
+        {
+            return *left * *right;
+        }
+
+        return {};
+    }
+
+    bool merge(Data &to, const Data &from)
+    {
+        if (!to && from)
+        {
+            to = from;
+            return true;
+        }
+
+        assert(!to || !from || *to == *from);
+        return false;
+    }
+
+    template <typename GraphType>
+    void modify(GraphType &eGraph, e::ClassId classId)
+    {
+        if (const auto &data = eGraph.getData(classId))
+        {
+            eGraph.unite(classId, eGraph.addTerm(std::to_string(*data)));
+        }
+    }
+};
+
+struct ConstantFoldingConfig : e::DefaultGraphConfig
+{
+    using Analysis = ConstantFolding;
+};
+
+void constantFoldingAnalysisTest()
+{
+    // given
+    e::BasicGraph<ConstantFoldingConfig> eGraph;
+
+    // when
+    const auto expr1 = makeExpression("(10 + ((20 + 20) * 30)) * 40", eGraph);
+    const auto expr2 = makeExpression("(x * 3) + 1", eGraph);
+    const auto expr3 = makeExpression("(y - x) * 2", eGraph);
+    eGraph.restoreInvariants();
+
+    // then
+    assert(eGraph.find(expr1) == eGraph.find(eGraph.addTerm("48400")));
+    assert(!eGraph.getData(expr2).has_value());
+
+    // and when
+    eGraph.unite(eGraph.addTerm("x"), eGraph.addTerm("2"));
+    eGraph.unite(eGraph.addTerm("y"), makeExpression("(x * x) + 3", eGraph));
+    eGraph.restoreInvariants();
+
+    // then
+    assert(eGraph.getData(expr2) == int64_t(7));
+    assert(eGraph.find(expr2) == eGraph.find(eGraph.addTerm("7")));
+    assert(eGraph.find(expr3) == eGraph.find(eGraph.addTerm("10")));
+}
+
+void conditionalRewriteTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto aa = makeExpression("a / a", eGraph);
+    const auto zeros = makeExpression("0 / 0", eGraph);
+    const auto sum1 = makeExpression("2 + 3", eGraph);
+    const auto sum2 = makeExpression("a + 3", eGraph);
+
+    const auto zero = eGraph.addTerm("0");
+
+    auto division = makeRewriteRule("$x / $x => 1");
+    division.guard = [zero](const e::SymbolBindings &bindings, const e::Graph &graph)
+    {
+        return graph.find(*bindings.find("$x")) != graph.find(zero);
+    };
+
+    const auto getNumber = [](const e::Graph &graph, e::ClassId classId) -> e::Optional<int>
+    {
+        for (const auto &termId : graph.classes[graph.find(classId)].terms)
+        {
+            const auto name = graph.terms.getName(termId).toString();
+            if (graph.terms.getChildren(termId).empty() && std::isdigit(name.front()))
+            {
+                return std::stoi(name);
+            }
+        }
+
+        return {};
+    };
+
+    const e::RewriteRule addition(makeRewriteRule("$x + $y => $x").leftHand,
+        [getNumber](const e::SymbolBindings &bindings, e::Graph &graph) -> e::Optional<e::ClassId>
+        {
+            const auto x = getNumber(graph, *bindings.find("$x"));
+            const auto y = getNumber(graph, *bindings.find("$y"));
+            if (!x || !y)
+            {
+                return {};
+            }
+
+            return graph.addTerm(std::to_string(*x + *y));
+        });
+
+    // when
+    eGraph.rewrite({division, addition});
+
+    // then
+    const auto one = eGraph.addTerm("1");
+    assert(eGraph.find(aa) == eGraph.find(one));
+    assert(eGraph.find(zeros) != eGraph.find(one));
+    assert(eGraph.find(sum1) == eGraph.find(eGraph.addTerm("5")));
+    assert(eGraph.classes[eGraph.find(sum2)].terms.size() == 1);
+    assert(eGraph.getClassesCount() == 8);
+}
+
+void matchRootsTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto expr1 = makeExpression("(a - a) * 1", eGraph);
+    const auto expr2 = makeExpression("(b - c) * 1", eGraph);
+
+    const auto rule = makeRewriteRule("($x - $x) * 1 => 0");
+    const e::RewriteRule relationalRule(rule.leftHand, rule.rightHand, e::MatchingEngine::Relational);
+
+    // when
+    const auto matches1 = eGraph.search(rule);
+    const auto matches2 = eGraph.search(relationalRule);
+    const auto termsCount = eGraph.getTermsCount();
+    eGraph.rewrite(rule);
+
+    // then
+    assert(matches1.size() == 1 && matches2.size() == 1);
+    assert(matches1[0].root == expr1 && matches2[0].root == expr1);
+    assert(eGraph.getTermsCount() == termsCount + 1);
+    assert(eGraph.find(expr1) == eGraph.find(eGraph.addTerm("0")));
+    assert(eGraph.find(expr2) != eGraph.find(expr1));
+}
+
 void serializationTest()
 {
     // given
@@ -125,11 +717,630 @@ void serializationTest()
     assert(otherGraph.find(expr1) == eGraph.find(expr1));
 }
 
+void snapshotTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto expr1 = makeExpression("(10 + ((20 + 30) + 40)) + 50", eGraph);
+    const auto expr2 = makeExpression("50 + ((40 + (30 + 20)) + 10)", eGraph);
+    eGraph.rewrite(makeRewriteRule("$x + $y => $y + $x"));
+
+    // when
+    const auto snapshot = e::makeSnapshot(eGraph);
+    const auto view = e::SnapshotView::open(snapshot.data(), snapshot.size() * sizeof(uint32_t));
+
+    // then
+    assert(view.has_value());
+    assert(view->getClassesCount() == eGraph.classes.size());
+    assert(view->find(expr1) == eGraph.find(expr1));
+    assert(view->find(expr2) == eGraph.find(expr2));
+
+    const auto termId = eGraph.classes[eGraph.find(expr1)].terms.front();
+    assert(view->getName(termId) == "+");
+    assert(view->getChildren(termId).toVector() == eGraph.terms.getChildren(termId).toVector());
+    assert(!e::SnapshotView::open(snapshot.data(), 4).has_value());
+
+    // and when
+    e::SnapshotHeader header;
+    std::memcpy(&header, snapshot.data(), sizeof(e::SnapshotHeader));
+    const auto childrenBegin = sizeof(e::SnapshotHeader) / sizeof(uint32_t) +
+        (header.symbolsCount + 1) + (header.charsCount + 3) / 4 + header.termsCount * 3;
+
+    auto badChild = snapshot;
+    badChild[childrenBegin] = header.classesCount;
+    auto badSymbol = snapshot;
+    badSymbol[childrenBegin - 3] = header.symbolsCount;
+    auto badChildrenCount = snapshot;
+    badChildrenCount[childrenBegin - 1] = header.childrenCount;
+
+    // then
+    assert(!e::SnapshotView::open(badChild.data(), badChild.size() * sizeof(uint32_t)).has_value());
+    assert(!e::SnapshotView::open(badSymbol.data(), badSymbol.size() * sizeof(uint32_t)).has_value());
+    assert(!e::SnapshotView::open(badChildrenCount.data(), badChildrenCount.size() * sizeof(uint32_t)).has_value());
+
+    // and when
+    auto otherGraph = view->load();
+
+    // then
+    assert(otherGraph.find(expr1) == otherGraph.find(expr2));
+    assert(otherGraph.getClassesCount() == eGraph.getClassesCount());
+    assert(e::makeSnapshot(otherGraph) == snapshot);
+
+    otherGraph.rewrite(makeRewriteRule("$x + $y => $y + $x"));
+    assert(otherGraph.getClassesCount() == eGraph.getClassesCount());
+
+#if EGRAPH_HAS_POSIX
+
+    // and when
+    const auto path = "EGraphSnapshotTest.bin";
+    {
+        std::ofstream file(path, std::ios::binary);
+        e::writeSnapshot(eGraph, file);
+    }
+
+    {
+        const e::MappedSnapshot mappedSnapshot(path);
+        const auto mappedView = mappedSnapshot.getView();
+
+        // then
+        assert(mappedView.has_value());
+        assert(mappedView->find(expr1) == eGraph.find(expr2));
+        assert(mappedView->load().find(expr1) == eGraph.find(expr1));
+    }
+
+    std::remove(path);
+
+#endif
+}
+
+void snapshotDeltaTest()
+{
+    // given
+    e::Graph eGraph;
+    makeExpression("((a * 2) / 2) + (b * (c + 0))", eGraph);
+    eGraph.restoreInvariants();
+
+    std::stringstream stream;
+    auto output = e::makeStreamOutput(stream, 5);
+    e::writeSnapshotWords(eGraph, output);
+    assert(output.flush());
+
+    const auto base = e::makeSnapshot(eGraph);
+    assert(stream.str() == std::string(reinterpret_cast<const char *>(base.data()), base.size() * sizeof(uint32_t)));
+
+    e::Journal journal;
+    journal.checkpoint(eGraph);
+    eGraph.journal = &journal;
+
+    // when
+    const auto expr = makeExpression("(a * 2) / 2", eGraph);
+    e::Runner(eGraph).run({
+        makeRewriteRule("($x * $y) / $z => $x * ($y / $z)"),
+        makeRewriteRule("$x / $x => 1"),
+        makeRewriteRule("$x * 1 => $x"),
+        makeRewriteRule("$x + 0 => $x")});
+
+    const auto delta = e::makeDelta(journal);
+
+    auto otherGraph = e::SnapshotView::open(base.data(), base.size() * sizeof(uint32_t))->load();
+    const auto isApplied = e::applyDelta(otherGraph, delta.data(), delta.size() * sizeof(uint32_t));
+
+    // then
+    assert(isApplied);
+    assert(eGraph.find(expr) == eGraph.find(eGraph.addTerm("a")));
+    assert(otherGraph.getTermsCount() == eGraph.getTermsCount());
+    assert(otherGraph.getClassesCount() == eGraph.getClassesCount());
+    for (e::ClassId classId = 0; classId < e::ClassId(eGraph.classes.size()); ++classId)
+    {
+        assert(otherGraph.find(classId) == eGraph.find(classId));
+        assert(otherGraph.classes[classId].terms == eGraph.classes[classId].terms);
+    }
+
+    assert(!e::applyDelta(otherGraph, delta.data(), delta.size() * sizeof(uint32_t)));
+
+    // and when
+    const auto makeUniteDelta = [&otherGraph](uint32_t type, uint32_t id1, uint32_t id2)
+    {
+        e::DeltaHeader header;
+        header.baseTermsCount = uint32_t(otherGraph.getTermsCount());
+        header.baseClassesCount = uint32_t(otherGraph.classes.size());
+        header.entriesWordsCount = 3;
+
+        e::Vector<uint32_t> words(sizeof(e::DeltaHeader) / sizeof(uint32_t));
+        std::memcpy(words.data(), &header, sizeof(e::DeltaHeader));
+        words.insert(words.end(), {0, type, id1, id2}); // no symbols, then the entry
+        return words;
+    };
+
+    const auto unite = uint32_t(e::Journal::Type::Unite);
+    const auto classesCount = uint32_t(otherGraph.classes.size());
+    const auto badType = makeUniteDelta(unite | 0x100, 0, 1);
+    const auto badId = makeUniteDelta(unite, 0, classesCount);
+    const auto goodDelta = makeUniteDelta(unite, 0, 1);
+
+    // then
+    assert(!e::applyDelta(otherGraph, badType.data(), badType.size() * sizeof(uint32_t)));
+    assert(!e::applyDelta(otherGraph, badId.data(), badId.size() * sizeof(uint32_t)));
+    assert(e::applyDelta(otherGraph, goodDelta.data(), goodDelta.size() * sizeof(uint32_t)));
+}
+
+void addDagTest()
+{
+    // given
+    e::Graph eGraph;
+    const auto a = eGraph.addTerm("a");
+
+    e::TermDag dag;
+    const auto na = dag.addNode("a", {});
+    const auto nb = dag.addNode("b", {});
+    const e::Vector<uint32_t> ab{na, nb};
+    const auto nsum = dag.addNode("+", ab);
+    const e::Vector<uint32_t> sums{nsum, nsum};
+    const auto nproduct = dag.addNode("*", sums);
+    dag.addNode("a", {});
+
+    // when
+    const auto ids = eGraph.addDag(dag);
+
+    // then
+    assert(ids.size() == 5);
+    assert(ids[na] == a && ids[4] == a);
+    assert(eGraph.getClassesCount() == 4);
+    assert(eGraph.find(ids[nproduct]) == eGraph.find(makeExpression("(a + b) * (a + b)", eGraph)));
+    assert(eGraph.getClassesCount() == 4);
+    assert(eGraph.classes[ids[nsum]].parents.size() == 2);
+
+    // and when
+    eGraph.rewrite(makeRewriteRule("$x * $x => $x"));
+    const e::Extractor<size_t> extractor(eGraph, e::astSize);
+
+    e::Graph otherGraph;
+    const auto otherIds = otherGraph.addDag(*extractor.extractDag(ids[nproduct]));
+
+    // then
+    assert(otherGraph.getClassesCount() == 3);
+    assert(otherGraph.find(otherIds.back()) == otherGraph.find(makeExpression("a + b", otherGraph)));
+}
+
+struct ExplanationsConfig : e::DefaultGraphConfig
+{
+    using Explanations = e::ProofForest;
+};
+
+using ExplainedGraph = e::BasicGraph<ExplanationsConfig>;
+
+// Checks that the steps go from one node to another, and so do the children's steps
+bool isChained(const ExplainedGraph &eGraph, const e::ProofForest::Explanation &explanation,
+    e::ClassId from, e::ClassId to)
+{
+    auto current = from;
+    for (const auto &step : explanation)
+    {
+        if (step.from != current || eGraph.find(step.from) != eGraph.find(step.to))
+        {
+            return false;
+        }
+
+        if (step.type == e::Justification::Type::Congruence)
+        {
+            const auto fromChildren = eGraph.explanations.getChildren(step.from);
+            const auto toChildren = eGraph.explanations.getChildren(step.to);
+            for (size_t i = 0; i < fromChildren.size(); ++i)
+            {
+                if (!isChained(eGraph, step.childrenSteps[i], fromChildren[i], toChildren[i]))
+                {
+                    return false;
+                }
+            }
+        }
+
+        current = step.to;
+    }
+
+    return current == to;
+}
+
+void explanationsTest()
+{
+    // given
+    ExplainedGraph eGraph;
+    static_assert(!e::Graph::hasExplanations);
+
+    const auto expression = makeExpression("(a * 2) / 2", eGraph);
+    const auto a = eGraph.addTerm("a");
+    const auto b = eGraph.addTerm("b");
+
+    const e::Vector<ExplainedGraph::RewriteRule> rules{
+        makeRewriteRule<ExplainedGraph>("($x * $y) / $z => $x * ($y / $z)"),
+        makeRewriteRule<ExplainedGraph>("$x / $x => 1"),
+        makeRewriteRule<ExplainedGraph>("$x * 1 => $x")};
+
+    // when
+    for (int i = 0; i < 3; ++i)
+    {
+        eGraph.rewrite(rules);
+    }
+
+    eGraph.unite(b, a);
+
+    // then
+    assert(eGraph.find(expression) == eGraph.find(a));
+
+    const auto explanation = eGraph.explain(expression, a);
+    assert(isChained(eGraph, explanation, expression, a));
+
+    // (/ (* a 2) 2) = (* a (/ 2 2)) = (* a 1) = a, where the second step
+    // is the congruence of (/ 2 2) = 1
+    using Type = e::Justification::Type;
+    assert(explanation.size() == 3);
+    assert(explanation[0].type == Type::Rule && explanation[0].ruleName == rules[0].name);
+    assert(explanation[1].type == Type::Congruence);
+    assert(explanation[1].childrenSteps[0].empty());
+    assert(explanation[1].childrenSteps[1].size() == 1);
+    assert(explanation[1].childrenSteps[1][0].ruleName == rules[1].name);
+    assert(explanation[2].type == Type::Rule && explanation[2].ruleName == rules[2].name);
+
+    assert(eGraph.explanations.toString(explanation[0].from) == "(/ (* a 2) 2)");
+    assert(eGraph.explanations.toString(explanation[1].to) == "(* a 1)");
+
+    const auto given = eGraph.explain(expression, b);
+    assert(isChained(eGraph, given, expression, b));
+    assert(given.back().type == Type::Given);
+    assert(eGraph.explain(a, a).empty());
+}
+
+struct StatsConfig : e::DefaultGraphConfig
+{
+    using Stats = e::GraphStats;
+};
+
+void statsTest()
+{
+    // given
+    e::BasicGraph<StatsConfig> eGraph;
+    static_assert(!e::Graph::hasStats);
+
+    eGraph.addTerm("0");
+    makeExpression("((a - b) * 0) * ((b + c) * 0)", eGraph);
+
+    // when
+    e::Runner runner(eGraph);
+    const auto report = runner.run({makeRewriteRule<e::BasicGraph<StatsConfig>>("$x * 0 => 0")});
+
+    // then
+    const auto &stats = eGraph.stats;
+
+    assert(stats.rules.size() == 1);
+    assert(stats.rules[0].name == e::Symbol("$x * 0 => 0"));
+    assert(stats.rules[0].searches == report.iterations);
+    assert(stats.rules[0].matches == 2 + 3 + 3);
+
+    assert(stats.addMisses == eGraph.getTermsCount());
+    assert(stats.addHits == 3 + stats.rules[0].matches); // each match adds 0 again
+    assert(stats.unionsCount == 3);
+    assert(stats.uniteCalls == stats.rules[0].matches);
+    assert(stats.repairPassesCount > 0 && stats.maxWorklistSize > 0);
+
+    assert(stats.iterations.size() == report.iterations);
+    for (const auto &iteration : stats.iterations)
+    {
+        assert(iteration.searchStartTime <= iteration.applyStartTime);
+        assert(iteration.applyStartTime <= iteration.rebuildStartTime);
+        assert(iteration.rebuildStartTime <= iteration.endTime);
+    }
+
+    assert(stats.iterations.back().unitedCount == 0);
+    assert(stats.iterations.back().classesCount == eGraph.getClassesCount());
+
+    assert(stats.toJson().find("\"searches\":3") != std::string::npos);
+    assert(stats.toChromeTrace().find("\"name\":\"rebuild\"") != std::string::npos);
+
+    const auto footprint = e::getFootprint(eGraph);
+    assert(footprint.classesCount == eGraph.getClassesCount());
+    assert(footprint.classesCount + footprint.deadClassesCount == eGraph.classes.size());
+    assert(footprint.termsCount == eGraph.getTermsCount());
+    assert(footprint.getTotalMemory() > footprint.termsMemory);
+}
+
+void compactionTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto expr1 = makeExpression("(a + b) + c", eGraph);
+    const auto expr2 = makeExpression("c + (b + a)", eGraph);
+
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x + $y => $y + $x"),
+        makeRewriteRule("$x + ($y + $z) => ($x + $y) + $z")};
+
+    e::Runner(eGraph).run(rules);
+
+    const auto classesCount = eGraph.getClassesCount();
+    const auto oldClassesCount = eGraph.classes.size();
+    assert(classesCount < oldClassesCount);
+    assert(eGraph.getTermsCount() > eGraph.termsLookup.size());
+
+    // when
+    const auto newIds = eGraph.compact();
+
+    // then
+    assert(newIds.size() == oldClassesCount);
+    assert(eGraph.classes.size() == classesCount);
+    assert(eGraph.unionFind.size() == classesCount);
+    assert(eGraph.getTermsCount() == eGraph.termsLookup.size());
+    assert(newIds[expr1] == newIds[expr2]);
+
+    for (const auto &eClass : eGraph.classes)
+    {
+        assert(eClass.isAlive());
+        assert(eGraph.find(eClass.id) == eClass.id);
+
+        auto parentTermIds = eClass.parents;
+        std::sort(parentTermIds.begin(), parentTermIds.end(),
+            [](const e::TermWithLeafId &l, const e::TermWithLeafId &r) { return l.termId < r.termId; });
+        assert(std::adjacent_find(parentTermIds.begin(), parentTermIds.end(),
+            [](const e::TermWithLeafId &l, const e::TermWithLeafId &r) { return l.termId == r.termId; }) ==
+            parentTermIds.end());
+    }
+
+    // and when
+    const auto termsCount = eGraph.getTermsCount();
+    const auto expr3 = makeExpression("b + (c + a)", eGraph);
+    e::Runner(eGraph).run(rules);
+
+    // then
+    assert(eGraph.find(expr3) == newIds[expr1]);
+    assert(eGraph.getClassesCount() == classesCount);
+    assert(eGraph.termsLookup.size() == termsCount);
+
+    // and when
+    const auto expr4 = makeExpression("(a + b) + d", eGraph);
+    eGraph.unite(eGraph.addTerm("c"), eGraph.addTerm("d"));
+    eGraph.restoreInvariants();
+
+    // then
+    assert(eGraph.find(expr4) == eGraph.find(expr3));
+}
+
+void compactionWithCongruentTermsTest()
+{
+    // given
+    e::Graph eGraph;
+
+    const auto a = eGraph.addTerm("a");
+    const auto b = eGraph.addTerm("b");
+    const auto c = eGraph.addTerm("c");
+    const auto fa = eGraph.addOperation("f", e::Vector<e::ClassId>{a});
+    const auto fb = eGraph.addOperation("f", e::Vector<e::ClassId>{b});
+
+    eGraph.unite(fa, fb);
+    eGraph.unite(fa, c);
+    eGraph.restoreInvariants();
+    eGraph.unite(b, a);
+    eGraph.restoreInvariants();
+
+    // the class keeps one of the congruent terms, and the lookup has the other one
+    const auto &terms = eGraph.classes[eGraph.find(fa)].terms;
+    assert(terms.size() == 2);
+
+    const auto classTermId = eGraph.terms.getChildren(terms.front()).empty() ? terms.back() : terms.front();
+    const auto lookupTermId = eGraph.termsLookup.findEntry(eGraph.terms, classTermId)->termId;
+    assert(classTermId != lookupTermId);
+
+    for (const auto &prunedTermId : {classTermId, lookupTermId})
+    {
+        // when
+        auto graph = eGraph;
+        const auto newIds = graph.compact([prunedTermId](e::TermId termId, e::ClassId)
+            { return termId != prunedTermId; });
+
+        // then
+        const auto isPruned = (prunedTermId == classTermId);
+        assert(graph.classes[newIds[fa]].terms.size() == (isPruned ? 1 : 2));
+        assert(graph.getTermsCount() == (isPruned ? 3 : 4));
+
+        const auto f = graph.addOperation("f", e::Vector<e::ClassId>{newIds[b]});
+        assert((graph.find(f) == newIds[c]) == !isPruned);
+    }
+}
+
+void pruningTest()
+{
+    // given
+    e::Graph eGraph;
+
+    auto expr = makeExpression("((a * 1) + (b * 0)) * ((a * 1) + (b * 0))", eGraph);
+
+    const e::Vector<e::RewriteRule> rules{
+        makeRewriteRule("$x * 1 => $x"),
+        makeRewriteRule("$x * 0 => 0"),
+        makeRewriteRule("$x + 0 => $x"),
+        makeRewriteRule("$x * $y => $y * $x")};
+
+    e::Runner(eGraph).run(rules);
+
+    const e::Extractor<size_t> extractor(eGraph, e::astSize);
+    const auto cost = extractor.getCost(expr);
+    const auto term = extractor.extractTerm(expr)->toString();
+
+    // when
+    const auto newIds = e::pruneExpensiveTerms(eGraph, extractor);
+    expr = newIds[expr];
+
+    // then
+    for (const auto &eClass : eGraph.classes)
+    {
+        assert(eClass.terms.size() == 1);
+    }
+
+    const e::Extractor<size_t> newExtractor(eGraph, e::astSize);
+    assert(newExtractor.getCost(expr) == cost);
+    assert(newExtractor.extractTerm(expr)->toString() == term);
+
+    // and when
+    e::SaturationLimits limits;
+    limits.memory = eGraph.getMemoryUsage() / 2;
+
+    size_t prunesCount = 0;
+    e::Runner runner(eGraph, limits);
+    runner.pruner = [&](e::Graph &graph)
+    {
+        const e::Extractor<size_t> pruningExtractor(graph, e::astSize);
+        expr = e::pruneExpensiveTerms(graph, pruningExtractor)[expr];
+        prunesCount++;
+    };
+
+    const auto report = runner.run(rules);
+
+    // then
+    assert(report.stopReason == e::StopReason::MemoryLimit);
+    assert(report.iterations == 0);
+    assert(prunesCount == 1);
+    assert(eGraph.find(expr) == expr);
+}
+
+using BinaryGraph = e::BasicGraph<e::FixedArityGraphConfig<2>>;
+
+void fixedArityTermsTest()
+{
+    // given
+    e::Graph eGraph1;
+    BinaryGraph eGraph2;
+
+    const auto expression = "((a * 2) / 2) + ((b + 0) * c)";
+    const auto expr1 = makeExpression(expression, eGraph1);
+    const auto expr2 = makeExpression(expression, eGraph2);
+
+    const e::Vector<std::string> rules{
+        "$x + $y => $y + $x",
+        "$x * $y => $y * $x",
+        "($x * $y) / $y => $x",
+        "$x + 0 => $x"};
+
+    e::Vector<e::RewriteRule> rules1;
+    e::Vector<BinaryGraph::RewriteRule> rules2;
+    for (const auto &rule : rules)
+    {
+        rules1.push_back(makeRewriteRule(rule));
+        rules2.push_back(makeRewriteRule<BinaryGraph>(rule));
+    }
+
+    // when
+    const auto report1 = e::Runner(eGraph1).run(rules1);
+    const auto report2 = e::Runner(eGraph2).run(rules2);
+
+    // then
+    assert(report1.stopReason == e::StopReason::Saturated);
+    assert(report2.stopReason == e::StopReason::Saturated);
+    assert(eGraph1.getClassesCount() == eGraph2.getClassesCount());
+    assert(eGraph1.getTermsCount() == eGraph2.getTermsCount());
+    assert(eGraph2.find(expr2) == eGraph2.find(makeExpression("(c * b) + a", eGraph2)));
+
+    const e::Extractor<size_t> extractor1(eGraph1, e::astSize);
+    const e::Extractor<size_t, BinaryGraph> extractor2(eGraph2, e::astSize);
+    assert(extractor2.getCost(expr2) == extractor1.getCost(expr1));
+    assert(extractor2.extractTerm(expr2)->toString() == extractor1.extractTerm(expr1)->toString());
+
+    // and when
+    eGraph2.compact();
+
+    // then
+    assert(eGraph2.getTermsCount() == eGraph2.termsLookup.size());
+    assert(eGraph2.terms.getMemoryUsage() ==
+        eGraph2.terms.terms.capacity() * sizeof(e::FixedArityTerm<2>));
+}
+
+using PmrGraph = e::BasicGraph<e::PmrGraphConfig>;
+
+void sharedRuleSetTest()
+{
+    // given
+    const auto ruleSet = makeRuleSet<PmrGraph>({
+        "$x + $y => $y + $x",
+        "$x * $y => $y * $x",
+        "$x * ($y + $z) => ($x * $y) + ($x * $z)",
+        "$x * 1 => $x"});
+
+    const e::Vector<std::string> expressions{
+        "(a * (b + c)) * 1", "(b * a) + (c * a)", "(c + b) * a", "a * (b * 1)"};
+
+    e::Vector<std::thread> threads;
+    e::Vector<size_t> termsCounts(8, 0);
+    e::Vector<char> areEquivalent(8, false); // not Vector<bool>, whose items share the words
+
+    // when
+    for (size_t i = 0; i < termsCounts.size(); ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            // a copy is just another reference to the same rules
+            const auto rules = ruleSet;
+
+            std::pmr::monotonic_buffer_resource arena;
+            PmrGraph eGraph(&arena);
+
+            const auto expr1 = makeExpression(expressions[0], eGraph);
+            const auto expr2 = makeExpression(expressions[1], eGraph);
+            const auto expr3 = makeExpression(expressions[2], eGraph);
+            makeExpression(expressions[3], eGraph);
+
+            e::Runner<PmrGraph>(eGraph).run(rules);
+            const auto newIds = eGraph.compact();
+
+            // the operator index is rebuilt by compacting, still in the arena
+            assert(eGraph.classesByOperator.begin()->second.get_allocator().resource() == &arena);
+
+            termsCounts[i] = eGraph.getTermsCount();
+            areEquivalent[i] = newIds[expr1] == newIds[expr2] && newIds[expr2] == newIds[expr3];
+        });
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    // then
+    assert(ruleSet.size() == 4);
+    for (size_t i = 0; i < termsCounts.size(); ++i)
+    {
+        assert(termsCounts[i] == termsCounts.front());
+        assert(areEquivalent[i]);
+    }
+}
+
 int main(int argc, char **argv)
 {
     rewriteIdentityRuleTest();
     rewriteZeroRuleTest();
     rewriteAssociativityRuleTest();
     rewriteDistributivityRuleTest();
+    batchRewriteTest();
+    saturationTest();
+    saturationLimitsTest();
+    statsTest();
+    backoffSchedulerTest();
+    relationalMatchingTest();
+    parallelSearchTest();
+    concurrentRebuildTest();
+    canonicalizationTest<e::UnionFind<e::ClassId>>();
+    canonicalizationTest<e::ConcurrentUnionFind<e::ClassId>>();
+    extractionTest();
+    deepExtractionTest();
+    incrementalExtractionTest();
+    compactionTest();
+    compactionWithCongruentTermsTest();
+    pruningTest();
+    fixedArityTermsTest();
+    sharedRuleSetTest();
+    constantFoldingAnalysisTest();
+    conditionalRewriteTest();
+    matchRootsTest();
+    explanationsTest();
     serializationTest();
+    addDagTest();
+    snapshotTest();
+    snapshotDeltaTest();
 }